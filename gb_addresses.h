@@ -86,6 +86,8 @@ constexpr auto addr_NR44 = 0xFF23;
 constexpr auto addr_NR50 = 0xFF24;
 constexpr auto addr_NR51 = 0xFF25;
 constexpr auto addr_NR52 = 0xFF26;
+// Wave pattern RAM, 32 4-bit samples
+constexpr auto addr_wav = 0xFF30;
 // PPU & OAM related registers
 constexpr auto addr_lcd = 0xFF40;
 constexpr auto addr_sta = 0xFF41;
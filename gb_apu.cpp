@@ -1,69 +1,245 @@
 #include <GameboyTKP/gb_apu.h>
 #include <GameboyTKP/gb_addresses.h>
+#include <GameboyTKP/gb_state.h>
+#include <algorithm>
 #include <iostream>
 constexpr int SAMPLE_RATE = 48000;
-constexpr int AMPLITUDE = 8000;
-constexpr int RESAMPLED_RATE = (4194304 / SAMPLE_RATE);
+// Level of one step of channel output times NR50 volume, all four channels
+// at full volume still fit in a sample
+constexpr int VOLUME_UNIT = 64;
+constexpr int CLOCK_SPEED = 4194304;
+// Right shift of a wave sample for each NR32 output level, 4 mutes
+constexpr int WAVE_SHIFTS[4] = { 4, 0, 1, 2 };
 
 namespace TKPEmu::Gameboy::Devices {
-    APU::APU(ChannelArrayPtr channel_array_ptr, uint8_t& NR52) 
-            : channel_array_ptr_(channel_array_ptr), NR52_(NR52) {}
-    APU::~APU() {
-        if (UseSound) {
-            SDL_CloseAudioDevice(device_id_);
+    APU::APU(ChannelArrayPtr channel_array_ptr, uint8_t& NR52, uint8_t* wave_ram) 
+            : NR52_(NR52), wave_ram_(wave_ram), channel_array_ptr_(channel_array_ptr) {}
+    void APU::InitSound() {
+        clear_frame();
+        if (sink_) {
+            sink_->Clear();
+        } else if (UseSound) {
+            auto sink = std::make_unique<SDLAudioSink>(SAMPLE_RATE, 2);
+            if (sink->IsOpen()) {
+                SetSink(std::move(sink));
+            }
         }
     }
-    void APU::InitSound() {
-        if (init_) {
-            SDL_ClearQueuedAudio(device_id_);
-            std::fill(samples_.begin(), samples_.end(), 0);
-            sample_index_ = 0;
+    void APU::SetSink(std::unique_ptr<AudioSink> sink) {
+        // The channels keep their timing across sinks
+        Sync();
+        sink_ = std::move(sink);
+        frame_clk_ = 0;
+        synced_clk_ = 0;
+        levels_ = {};
+        rate_ratio_ = 1;
+        fill_level_ = 0.5;
+        blips_.clear();
+        if (sink_) {
+            channels_ = sink_->GetChannels();
+            // Frames end a few clocks after FRAME_CLOCKS, twice that is plenty
+            int max_clocks = FRAME_CLOCKS * 2;
+            int rate = sink_->GetSampleRate();
+            blips_.emplace_back(CLOCK_SPEED, rate, max_clocks);
+            blips_.emplace_back(CLOCK_SPEED, rate, max_clocks);
+            size_t max_frames = static_cast<int64_t>(max_clocks) * rate / CLOCK_SPEED + 1;
+            samples_.assign(max_frames * channels_, 0);
+            mono_right_.assign(channels_ == 1 ? max_frames : 0, 0);
+        }
+        SetFastMode(fast_mode_);
+    }
+    void APU::SetMuted(bool muted) {
+        if (muted != muted_) {
+            if (muted) {
+                Sync();
+                muted_clk_ = frame_clk_;
+            } else {
+                frame_clk_ = muted_clk_;
+                synced_clk_ = muted_clk_;
+            }
+        }
+        muted_ = muted;
+        SetFastMode(fast_mode_);
+    }
+    void APU::SetChannelSink(int channel, std::unique_ptr<AudioSink> sink) {
+        auto& capture = captures_[channel];
+        capture.Sink = std::move(sink);
+        capture.Level = 0;
+        if (capture.Sink) {
+            int max_clocks = FRAME_CLOCKS * 2;
+            int rate = capture.Sink->GetSampleRate();
+            capture.Blip = std::make_unique<BlipBuffer>(CLOCK_SPEED, rate, max_clocks);
+            size_t max_frames = static_cast<int64_t>(max_clocks) * rate / CLOCK_SPEED + 1;
+            capture.Samples.assign(max_frames * capture.Sink->GetChannels(), 0);
+        } else {
+            capture.Blip.reset();
+        }
+    }
+    template<class Archive>
+    void APU::Serialize(Archive& archive) {
+        for (auto& channel : *channel_array_ptr_) {
+            channel.Serialize(archive);
+        }
+        if constexpr (Archive::Loading) {
+            // The loaded channels replace ones that already ran up to the
+            // current clock
+            synced_clk_ = frame_clk_;
+        }
+    }
+    TKP_GB_SERIALIZE_INSTANTIATE(APU)
+    void APU::Sync() {
+        int cycles = frame_clk_ - synced_clk_;
+        if (cycles > 0) {
+            for (int i = 0; i < 4; i++) {
+                run_channel(i, cycles);
+            }
+            synced_clk_ = frame_clk_;
+        }
+    }
+    void APU::run_channel(int channel, int cycles) {
+        auto& chan = (*channel_array_ptr_)[channel];
+        if (synthesize_) {
+            // Register writes since the last sync take effect here
+            update_level(channel, synced_clk_);
+        }
+        if (!synthesize_ || !is_audible(channel)) {
+            // Nothing to mix until something changes, which syncs first
+            switch (channel) {
+                case 2: chan.StepWaveGenerationCh3(cycles); break;
+                case 3: chan.StepWaveGenerationCh4(cycles); break;
+                default: chan.StepWaveGeneration(cycles); break;
+            }
             return;
         }
-        if (UseSound) {
-            SDL_AudioSpec want;
-            SDL_zero(want);
-            want.freq = SAMPLE_RATE;
-            want.format = AUDIO_S16SYS;
-            want.channels = 1;
-            want.samples = 512;
-            SDL_AudioSpec have;
-            // if (SDL_OpenAudio(&want, &have) != 0) {
-            //     SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
-            // }
-            device_id_ = SDL_OpenAudioDevice(0, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
-            if (want.format != have.format) {
-                SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to get the desired AudioSpec");
+        int clk = 0;
+        while (clk < cycles) {
+            switch (channel) {
+                case 2: clk += chan.StepToTransitionCh3(cycles - clk); break;
+                case 3: clk += chan.StepToTransitionCh4(cycles - clk); break;
+                default: clk += chan.StepToTransition(cycles - clk); break;
+            }
+            update_level(channel, synced_clk_ + clk);
+        }
+    }
+    bool APU::is_audible(int channel) {
+        auto& chan = (*channel_array_ptr_)[channel];
+        bool enabled = (NR52_ & 0b1000'0000) && (NR52_ & (1 << channel)) && chan.DACEnabled;
+        bool routed = chan.LeftEnabled || chan.RightEnabled || captures_[channel].Sink;
+        bool volume = channel == 2 ? chan.WaveOutputLevel != 0 : chan.EnvelopeCurrentVolume != 0;
+        return enabled && routed && volume;
+    }
+    int APU::get_output(int channel) {
+        auto& chan = (*channel_array_ptr_)[channel];
+        bool enabled = (NR52_ & 0b1000'0000) && (NR52_ & (1 << channel)) && chan.DACEnabled;
+        if (!enabled) {
+            return 0;
+        }
+        switch (channel) {
+            case 2: {
+                uint8_t byte = wave_ram_[chan.WaveDutyPosition / 2];
+                // High nibble plays first
+                uint8_t sample = (chan.WaveDutyPosition & 0b1) ? (byte & 0xF) : (byte >> 4);
+                return sample >> WAVE_SHIFTS[chan.WaveOutputLevel];
+            }
+            case 3: {
+                return !(chan.LFSR & 0b1) * chan.EnvelopeCurrentVolume;
+            }
+            default: {
+                return chan.GetAmplitude() * chan.EnvelopeCurrentVolume;
             }
-            float i = 0;
-            std::fill(samples_.begin(), samples_.end(), 0);
-            SDL_PauseAudioDevice(device_id_, 0);
-            init_ = true;
         }
     }
-    void APU::Update(int clk) {
-        if (UseSound) {
-            static int inner_clk = 0;
-            auto& chan1 = (*channel_array_ptr_)[0];
-            auto& chan2 = (*channel_array_ptr_)[1];
-            auto& chan4 = (*channel_array_ptr_)[3];
-            inner_clk += clk;
-            chan1.StepWaveGeneration(clk);
-            chan2.StepWaveGeneration(clk);
-            chan4.StepWaveGenerationCh4(clk);
-            double chan1out = (chan1.GetAmplitude() == 0.0 ? 1.0 : -1.0) * chan1.DACOutput * chan1.GlobalVolume() * !!chan1.EnvelopeCurrentVolume;
-            double chan2out = (chan2.GetAmplitude() == 0.0 ? 1.0 : -1.0) * chan2.DACOutput * chan2.GlobalVolume() * !!chan2.EnvelopeCurrentVolume;
-            double chan4out = (~chan4.LFSR & 0x01) * chan4.DACOutput * chan4.GlobalVolume() * !!chan4.EnvelopeCurrentVolume;
-            if (inner_clk >= RESAMPLED_RATE) {
-                auto sample = (chan1out + chan2out + chan4out) / 3;
-                samples_[sample_index_++] = sample * AMPLITUDE;
-                // in case it's bigger
-                inner_clk = inner_clk - RESAMPLED_RATE;
+    void APU::update_level(int channel, int clk) {
+        auto& chan = (*channel_array_ptr_)[channel];
+        int output = get_output(channel) * VOLUME_UNIT;
+        auto& capture = captures_[channel];
+        if (capture.Blip) {
+            // As loud as the channel is in the mix at the highest NR50 volume
+            int level = output * 8;
+            if (level != capture.Level) {
+                capture.Blip->AddDelta(clk, level - capture.Level);
+                capture.Level = level;
             }
-            if (sample_index_ == samples_.size()) {
-                sample_index_ = 0;
-                QueueSamples();
+        }
+        // NR50 volume 0 is 1/8 of the output, not silence
+        int left = chan.LeftEnabled * (chan.LeftVolume + 1) * output;
+        int right = chan.RightEnabled * (chan.RightVolume + 1) * output;
+        auto& levels = levels_[channel];
+        if (left != levels[0]) {
+            blips_[0].AddDelta(clk, left - levels[0]);
+            levels[0] = left;
+        }
+        if (right != levels[1]) {
+            blips_[1].AddDelta(clk, right - levels[1]);
+            levels[1] = right;
+        }
+    }
+    void APU::clear_frame() {
+        frame_clk_ = 0;
+        synced_clk_ = 0;
+        levels_ = {};
+        for (auto& blip : blips_) {
+            blip.Clear();
+        }
+        for (auto& capture : captures_) {
+            if (capture.Blip) {
+                capture.Blip->Clear();
+            }
+            capture.Level = 0;
+        }
+    }
+    void APU::end_frame() {
+        Sync();
+        if (muted_) {
+            // The frame is picked up again when unmuted
+            frame_clk_ = 0;
+            synced_clk_ = 0;
+            return;
+        }
+        if (!synthesize_) {
+            // Synthesis picks up from silence with an empty frame
+            clear_frame();
+            return;
+        }
+        for (auto& blip : blips_) {
+            blip.EndFrame(frame_clk_);
+        }
+        for (auto& capture : captures_) {
+            if (capture.Blip) {
+                capture.Blip->EndFrame(frame_clk_);
+                int channels = capture.Sink->GetChannels();
+                size_t frames = capture.Blip->ReadSamples(capture.Samples.data(), capture.Blip->GetSamplesAvailable(), channels);
+                for (size_t i = 0; i < frames; i++) {
+                    for (int j = 1; j < channels; j++) {
+                        capture.Samples[i * channels + j] = capture.Samples[i * channels];
+                    }
+                }
+                capture.Sink->Push(capture.Samples.data(), frames);
+            }
+        }
+        frame_clk_ = 0;
+        synced_clk_ = 0;
+        size_t frames = blips_[0].GetSamplesAvailable();
+        if (channels_ == 1) {
+            blips_[0].ReadSamples(samples_.data(), frames);
+            blips_[1].ReadSamples(mono_right_.data(), frames);
+            for (size_t i = 0; i < frames; i++) {
+                samples_[i] = (samples_[i] + mono_right_[i]) / 2;
+            }
+        } else {
+            // Any channels past the first two stay silent
+            blips_[0].ReadSamples(samples_.data(), frames, channels_);
+            blips_[1].ReadSamples(samples_.data() + 1, frames, channels_);
+        }
+        sink_->Push(samples_.data(), frames);
+        double fill = std::clamp(sink_->GetFillLevel(), 0.0, 1.0);
+        fill_level_ += (fill - fill_level_) / 8;
+        double ratio = 1 + (1 - 2 * fill_level_) * MAX_RATE_DELTA;
+        if (ratio != rate_ratio_) {
+            rate_ratio_ = ratio;
+            for (auto& blip : blips_) {
+                blip.SetRates(CLOCK_SPEED, sink_->GetSampleRate() * ratio);
             }
         }
     }
-}
\ No newline at end of file
+}
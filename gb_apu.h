@@ -1,33 +1,100 @@
 #pragma once
 #ifndef TKP_GB_APU_H
 #define TKP_GB_APU_H
-#include <SDL2/SDL.h>
 #include <queue>
+#include <memory>
+#include <vector>
 #include <GameboyTKP/gb_apu_ch.h>
+#include <GameboyTKP/gb_apu_blip.h>
+#include <GameboyTKP/gb_audio_sink.h>
 namespace TKPEmu::Gameboy::Devices {
     // This class is solely for sound output and is not needed to pass sound
     // emulation tests.
     // All computation for this class happens in gb_bus and gb_apu_ch
     class APU {
     public:
-        APU(ChannelArrayPtr channel_array_ptr, uint8_t& NR52);
-        ~APU();
+        APU(ChannelArrayPtr channel_array_ptr, uint8_t& NR52, uint8_t* wave_ram);
+        // Opens an SDL sink if UseSound is set and no sink is attached
         void InitSound();
-        void Update(int clk);
-        inline void QueueSamples() {
-            SDL_QueueAudio(device_id_, &samples_[0], sizeof(samples_));
+        // Only counts clocks, the channels run when Sync is called. Called after
+        // every memory access so it stays inline
+        inline void Update(int clk) {
+            frame_clk_ += clk;
+            if (frame_clk_ >= FRAME_CLOCKS) {
+                end_frame();
+            }
         }
-        inline bool IsQueueEmpty() {
-            return SDL_GetQueuedAudioSize(device_id_) < 100;
+        // Runs the channels up to the current clock, has to be called before
+        // anything changes their state
+        void Sync();
+        // Samples are only generated while a sink is attached
+        void SetSink(std::unique_ptr<AudioSink> sink);
+        // A real-time sink can't play faster than the hardware, so synthesis
+        // stops while in fast mode. Any other sink still gets every sample
+        inline void SetFastMode(bool fast_mode) {
+            fast_mode_ = fast_mode;
+            synthesize_ = sink_ && !muted_ && !(fast_mode_ && sink_->IsRealTime());
         }
+        // For frames that are run and then undone by loading a state, the
+        // channels pick up from the loaded state once unmuted and the sound
+        // continues from the clock it was muted at
+        void SetMuted(bool muted);
+        AudioSink* GetSink() { return sink_.get(); }
+        // Receives the output of one channel before NR50/NR51 mixing, at
+        // full volume. Only fed while the main sink is attached
+        void SetChannelSink(int channel, std::unique_ptr<AudioSink> sink);
+        // Lists the state saved in save states, see gb_state.h. Only the
+        // channels are saved, the samples already made are played as usual.
+        // Sync first so the saved channels are at the current clock
+        template<class Archive>
+        void Serialize(Archive& archive);
         bool UseSound = false;
     private:
-        SDL_AudioDeviceID device_id_;
-        std::array<int16_t, 512> samples_;
-        size_t sample_index_ = 0;
+        // Clocks in a video frame, samples are made and sent to the sink
+        // once per frame
+        static constexpr int FRAME_CLOCKS = 70224;
+        std::unique_ptr<AudioSink> sink_;
+        // When not set the channels still run, but nothing is mixed
+        bool synthesize_ = false;
+        bool fast_mode_ = false;
+        bool muted_ = false;
+        // Left and right, each channel adds its steps to the sides NR51
+        // routes it to, already scaled by the NR50 volume
+        std::vector<BlipBuffer> blips_;
+        std::vector<int16_t> samples_;
+        // Right side of a frame when the sink is mono
+        std::vector<int16_t> mono_right_;
+        int channels_ = 1;
+        // Sample rate multiplier, adjusted by up to MAX_RATE_DELTA to keep a
+        // real-time sink's buffer from running dry or overflowing
+        static constexpr double MAX_RATE_DELTA = 0.005;
+        double rate_ratio_ = 1;
+        // Averaged over a few frames, the device callback drains the sink in
+        // whole buffers so a single reading jumps around
+        double fill_level_ = 0.5;
+        // Clocks since the start of the frame and how far the channels ran
+        int frame_clk_ = 0;
+        int synced_clk_ = 0;
+        int muted_clk_ = 0;
+        // Left and right level of each channel as last added to the blips
+        std::array<std::array<int, 2>, 4> levels_{};
+        struct ChannelCapture {
+            std::unique_ptr<AudioSink> Sink;
+            std::unique_ptr<BlipBuffer> Blip;
+            std::vector<int16_t> Samples;
+            int Level = 0;
+        };
+        std::array<ChannelCapture, 4> captures_;
         uint8_t& NR52_;
+        uint8_t* wave_ram_;
         ChannelArrayPtr channel_array_ptr_;
-        bool init_ = false;
+        // The 4-bit value the channel currently outputs
+        int get_output(int channel);
+        bool is_audible(int channel);
+        void update_level(int channel, int clk);
+        void run_channel(int channel, int cycles);
+        void clear_frame();
+        void end_frame();
     };
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include <GameboyTKP/gb_apu_blip.h>
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+
+namespace TKPEmu::Gameboy::Devices {
+    BlipBuffer::BlipBuffer(int clock_rate, int sample_rate, int max_frame_clocks) :
+            factor_((static_cast<uint64_t>(sample_rate) << FRAC_BITS) / clock_rate) {
+        // The samples of a frame, the ones left from the last one and the
+        // kernel tail of the last step
+        size_t frame_samples = ((max_frame_clocks * factor_) >> FRAC_BITS) + 1;
+        buffer_.resize(frame_samples * 2 + KERNEL_WIDTH);
+        build_kernel();
+    }
+    void BlipBuffer::SetRates(double clock_rate, double sample_rate) {
+        factor_ = std::llround(sample_rate / clock_rate * (1ull << FRAC_BITS));
+    }
+    void BlipBuffer::build_kernel() {
+        // Blackman windowed sinc, cut off a bit below the Nyquist frequency
+        constexpr double cutoff = 0.9;
+        constexpr double pi = std::numbers::pi;
+        for (int phase = 0; phase < PHASES; phase++) {
+            std::array<double, KERNEL_WIDTH> taps;
+            double sum = 0;
+            for (int i = 0; i < KERNEL_WIDTH; i++) {
+                // The step lands this far after the middle of the kernel
+                double x = i - KERNEL_WIDTH / 2 - static_cast<double>(phase) / PHASES + 0.5;
+                double sinc = x == 0 ? 1 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+                double window = 0.42 + 0.5 * std::cos(2 * pi * x / KERNEL_WIDTH) + 0.08 * std::cos(4 * pi * x / KERNEL_WIDTH);
+                taps[i] = sinc * window;
+                sum += taps[i];
+            }
+            // Every phase has to add up to exactly one step, otherwise the
+            // integrated output drifts
+            int32_t total = 0;
+            for (int i = 0; i < KERNEL_WIDTH; i++) {
+                kernel_[phase][i] = std::lround(taps[i] / sum * (1 << KERNEL_BITS));
+                total += kernel_[phase][i];
+            }
+            kernel_[phase][KERNEL_WIDTH / 2] += (1 << KERNEL_BITS) - total;
+        }
+    }
+    void BlipBuffer::AddDelta(int clock, int delta) {
+        uint64_t position = offset_ + clock * factor_;
+        size_t index = position >> FRAC_BITS;
+        int phase = (position >> (FRAC_BITS - PHASE_BITS)) & (PHASES - 1);
+        int64_t* out = &buffer_[index];
+        const auto& kernel = kernel_[phase];
+        for (int i = 0; i < KERNEL_WIDTH; i++) {
+            out[i] += static_cast<int64_t>(delta) * kernel[i];
+        }
+    }
+    void BlipBuffer::EndFrame(int clock) {
+        offset_ += clock * factor_;
+        available_ = offset_ >> FRAC_BITS;
+    }
+    size_t BlipBuffer::ReadSamples(int16_t* out, size_t count, int stride) {
+        count = std::min(count, available_);
+        for (size_t i = 0; i < count; i++) {
+            integrator_ += buffer_[i];
+            int64_t sample = integrator_ >> KERNEL_BITS;
+            integrator_ -= integrator_ >> BASS_SHIFT;
+            out[i * stride] = std::clamp<int64_t>(sample, INT16_MIN, INT16_MAX);
+        }
+        // Move what's left, including the kernel tails, to the start
+        std::copy(buffer_.begin() + count, buffer_.end(), buffer_.begin());
+        std::fill(buffer_.end() - count, buffer_.end(), 0);
+        offset_ -= static_cast<uint64_t>(count) << FRAC_BITS;
+        available_ -= count;
+        return count;
+    }
+    void BlipBuffer::Clear() {
+        std::fill(buffer_.begin(), buffer_.end(), 0);
+        offset_ = 0;
+        available_ = 0;
+        integrator_ = 0;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef TKP_GB_APU_BLIP_H
+#define TKP_GB_APU_BLIP_H
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+namespace TKPEmu::Gameboy::Devices {
+    // Band-limited step synthesis. Channels add the change of their output at
+    // the clock it happens and the buffer turns the steps into samples at the
+    // output rate without aliasing, the samples are produced when a frame ends
+    class BlipBuffer {
+    public:
+        // max_frame_clocks is the longest frame that will be passed to EndFrame
+        BlipBuffer(int clock_rate, int sample_rate, int max_frame_clocks);
+        // Changes the output rate, only between frames. Rates a little above
+        // the one given at construction still fit
+        void SetRates(double clock_rate, double sample_rate);
+        // Clock is relative to the start of the current frame
+        void AddDelta(int clock, int delta);
+        // Samples before the clock become readable, the next frame starts there
+        void EndFrame(int clock);
+        size_t GetSamplesAvailable() { return available_; }
+        // Writes every stride-th sample of out, returns the samples read
+        size_t ReadSamples(int16_t* out, size_t count, int stride = 1);
+        void Clear();
+    private:
+        static constexpr int FRAC_BITS = 32;
+        static constexpr int PHASE_BITS = 5;
+        static constexpr int PHASES = 1 << PHASE_BITS;
+        static constexpr int KERNEL_WIDTH = 16;
+        static constexpr int KERNEL_BITS = 15;
+        // High-pass that removes the DC offset, about 15Hz at 48kHz
+        static constexpr int BASS_SHIFT = 9;
+        // Step response differences for each fractional sample position
+        std::array<std::array<int32_t, KERNEL_WIDTH>, PHASES> kernel_;
+        // Output samples per clock and the position of the frame start, in
+        // samples with FRAC_BITS fraction bits
+        uint64_t factor_;
+        uint64_t offset_ = 0;
+        std::vector<int64_t> buffer_;
+        size_t available_ = 0;
+        int64_t integrator_ = 0;
+        void build_kernel();
+    };
+}
+#endif
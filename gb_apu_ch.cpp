@@ -1,27 +1,92 @@
 #include <GameboyTKP/gb_apu_ch.h>
+#include <GameboyTKP/gb_state.h>
+#include <algorithm>
 #include <iostream>
 
 namespace TKPEmu::Gameboy::Devices {
+    template<class Archive>
+    void APUChannel::Serialize(Archive& archive) {
+        // Field by field, the struct has padding
+        archive(FrequencyTimer, WaveDutyPattern, WaveDutyPosition, MagicDivider, FrameSequencer);
+        archive(LengthCtrEnabled, VolEnvEnabled, EnvelopeCurrentVolume, EnvelopeIncrease, EnvelopePeriod);
+        archive(SweepPeriod, SweepIncrease, SweepShift, SweepEnabled, HasSweep, SweepTimer, ShadowFrequency, Frequency);
+        archive(LengthTimer, LengthHalf, LengthData, LengthDecOne, LengthInit, PeriodTimer);
+        archive(DACEnabled, LeftEnabled, LeftVolume, RightEnabled, RightVolume, DisableChannelFlag);
+        archive(Divisor, WidthMode, DivisorShift, LFSR, WaveOutputLevel, new_frequency);
+    }
+    TKP_GB_SERIALIZE_INSTANTIATE(APUChannel)
     void APUChannel::StepWaveGeneration(int cycles) {
-        FrequencyTimer -= cycles;
-        if (FrequencyTimer <= 0) {
-            FrequencyTimer += (2048 - Frequency) * 4;
-            // WaveDutyPosition stays in range 0-7
-            WaveDutyPosition = (WaveDutyPosition + 1) & 0b111;
-            DACOutput = ((DACInput / 7.5f) - 1.0f) * DACEnabled;
+        if (cycles < FrequencyTimer) {
+            FrequencyTimer -= cycles;
+            return;
+        }
+        // The frequency can't change in between, writes sync the APU first
+        int period = (2048 - Frequency) * 4;
+        int steps = 1 + (cycles - FrequencyTimer) / period;
+        // WaveDutyPosition stays in range 0-7
+        WaveDutyPosition = (WaveDutyPosition + steps) & 0b111;
+        FrequencyTimer = period - (cycles - FrequencyTimer) % period;
+    }
+    void APUChannel::StepWaveGenerationCh3(int cycles) {
+        if (cycles < FrequencyTimer) {
+            FrequencyTimer -= cycles;
+            return;
         }
+        int period = (2048 - Frequency) * 2;
+        int steps = 1 + (cycles - FrequencyTimer) / period;
+        // Position in wave RAM, 32 samples
+        WaveDutyPosition = (WaveDutyPosition + steps) & 0b11111;
+        FrequencyTimer = period - (cycles - FrequencyTimer) % period;
     }
     void APUChannel::StepWaveGenerationCh4(int cycles) {
+        int period = Divisor << DivisorShift;
+        while (cycles >= FrequencyTimer) {
+            cycles -= FrequencyTimer;
+            FrequencyTimer = period;
+            step_lfsr();
+        }
         FrequencyTimer -= cycles;
-        if (FrequencyTimer <= 0) {
-            FrequencyTimer = Divisor << DivisorShift;
-            auto xor_res = (LFSR & 0b01) ^ ((LFSR & 0b10) >> 1);
-            LFSR = (LFSR >> 1) | (xor_res << 14);
-            if (WidthMode) {
-                LFSR &= !(1 << 6);
-                LFSR |= xor_res << 6;
+    }
+    int APUChannel::StepToTransition(int cycles) {
+        // Every duty pattern has both levels, so the next change is at most
+        // 7 steps away
+        bool current = GetAmplitude();
+        int steps = 1;
+        while (steps < 8 && ((Waveforms[WaveDutyPattern] >> ((WaveDutyPosition + steps) & 0b111)) & 0b1) == current) {
+            ++steps;
+        }
+        int needed = FrequencyTimer + (steps - 1) * (2048 - Frequency) * 4;
+        cycles = std::min(cycles, needed);
+        StepWaveGeneration(cycles);
+        return cycles;
+    }
+    int APUChannel::StepToTransitionCh3(int cycles) {
+        // Any sample can differ from the last one
+        cycles = std::min(cycles, FrequencyTimer);
+        StepWaveGenerationCh3(cycles);
+        return cycles;
+    }
+    int APUChannel::StepToTransitionCh4(int cycles) {
+        int period = Divisor << DivisorShift;
+        bool current = LFSR & 0b1;
+        int stepped = 0;
+        while (cycles - stepped >= FrequencyTimer) {
+            stepped += FrequencyTimer;
+            FrequencyTimer = period;
+            step_lfsr();
+            if ((LFSR & 0b1) != current) {
+                return stepped;
             }
-            DACOutput = DACEnabled;
+        }
+        FrequencyTimer -= cycles - stepped;
+        return cycles;
+    }
+    void APUChannel::step_lfsr() {
+        auto xor_res = (LFSR & 0b01) ^ ((LFSR & 0b10) >> 1);
+        LFSR = (LFSR >> 1) | (xor_res << 14);
+        if (WidthMode) {
+            LFSR &= ~(1 << 6);
+            LFSR |= xor_res << 6;
         }
     }
     bool APUChannel::GetAmplitude() {
@@ -59,7 +124,6 @@ namespace TKPEmu::Gameboy::Devices {
                     } else if (EnvelopeCurrentVolume < 0xF && EnvelopeIncrease) {
                         ++EnvelopeCurrentVolume;
                     }
-                    DACInput = -EnvelopeCurrentVolume; // uhh idk. it sounds reversed if you dont add the '-' at the start
                 }
             }
         }
@@ -31,32 +31,41 @@ namespace TKPEmu::Gameboy::Devices {
         bool LengthDecOne = false;
         int LengthInit = 64;
         int PeriodTimer = 0;
-        int DACInput = 0;
-        float DACOutput = 1;
         bool DACEnabled = true;
         bool LeftEnabled = false;
         uint8_t LeftVolume = 0;
         bool RightEnabled = false;
         uint8_t RightVolume = 0;
         bool DisableChannelFlag = false;
-        unsigned Divisor = 0;
+        unsigned Divisor = 8;
         bool WidthMode = false;
         unsigned DivisorShift = 0;
         uint16_t LFSR = 0;
+        // NR32 output level, 0 mutes and 1-3 shift the sample right by 0-2
+        int WaveOutputLevel = 0;
 
+        // Advance the channel by any number of cycles, the square and wave
+        // channels in constant time
         void StepWaveGeneration(int cycles);
+        void StepWaveGenerationCh3(int cycles);
         void StepWaveGenerationCh4(int cycles);
+        // Advance up to the first step that may change the output and
+        // return the cycles it took, or all the cycles if there is none
+        int StepToTransition(int cycles);
+        int StepToTransitionCh3(int cycles);
+        int StepToTransitionCh4(int cycles);
         void StepFrameSequencer();
         bool GetAmplitude();
         void ClockLengthCtr();
         void ClockVolEnv();
         void ClockSweep();
         void CalculateSweepFreq();
-        inline uint8_t GlobalVolume() {
-            return ((LeftEnabled * LeftVolume) || (RightEnabled * RightVolume));
-        }
+        // Lists the state saved in save states, see gb_state.h
+        template<class Archive>
+        void Serialize(Archive& archive);
     private:
         int new_frequency = 0;
+        void step_lfsr();
     };
     using ChannelArray = std::array<APUChannel, 4>;
     using ChannelArrayPtr = std::shared_ptr<ChannelArray>;
@@ -0,0 +1,166 @@
+#include <GameboyTKP/gb_audio_sink.h>
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+namespace TKPEmu::Gameboy::Devices {
+    SampleRing::SampleRing(size_t capacity) :
+            buffer_(std::bit_ceil(capacity)),
+            mask_(buffer_.size() - 1) {}
+    size_t SampleRing::Push(const int16_t* samples, size_t count) {
+        size_t write = write_.load(std::memory_order_relaxed);
+        size_t read = read_.load(std::memory_order_acquire);
+        count = std::min(count, buffer_.size() - (write - read));
+        size_t start = write & mask_;
+        size_t first = std::min(count, buffer_.size() - start);
+        std::copy_n(samples, first, &buffer_[start]);
+        std::copy_n(samples + first, count - first, &buffer_[0]);
+        write_.store(write + count, std::memory_order_release);
+        return count;
+    }
+    size_t SampleRing::Pop(int16_t* samples, size_t count) {
+        size_t read = read_.load(std::memory_order_relaxed);
+        size_t write = write_.load(std::memory_order_acquire);
+        count = std::min(count, write - read);
+        size_t start = read & mask_;
+        size_t first = std::min(count, buffer_.size() - start);
+        std::copy_n(&buffer_[start], first, samples);
+        std::copy_n(&buffer_[0], count - first, samples + first);
+        read_.store(read + count, std::memory_order_release);
+        return count;
+    }
+    size_t SampleRing::GetSize() const {
+        return write_.load(std::memory_order_acquire) - read_.load(std::memory_order_acquire);
+    }
+    void SampleRing::Clear() {
+        read_.store(write_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+    void HashAudioSink::Push(const int16_t* samples, size_t frames) {
+        for (size_t i = 0; i < frames; i++) {
+            for (int j = 0; j < channels_; j++) {
+                uint16_t sample = samples[i * channels_ + j];
+                hash_ = (hash_ ^ (sample & 0xFF)) * FNV_PRIME;
+                hash_ = (hash_ ^ (sample >> 8)) * FNV_PRIME;
+            }
+            if (++second_frames_ == static_cast<size_t>(sample_rate_)) {
+                second_hashes_.push_back(hash_);
+                hash_ = FNV_OFFSET;
+                second_frames_ = 0;
+            }
+        }
+    }
+    std::string HashAudioSink::GetHashString() {
+        std::string ret;
+        auto append = [&ret](uint32_t hash) {
+            char hex[9];
+            std::snprintf(hex, sizeof(hex), "%08x", hash);
+            if (!ret.empty()) {
+                ret += '-';
+            }
+            ret += hex;
+        };
+        for (auto hash : second_hashes_) {
+            append(hash);
+        }
+        if (second_frames_ != 0) {
+            append(hash_);
+        }
+        return ret;
+    }
+    WavAudioSink::WavAudioSink(const std::string& path, int sample_rate, int channels) :
+            AudioSink(sample_rate, channels),
+            file_(path, std::ios::binary) {
+        if (file_.is_open()) {
+            write_header();
+        }
+    }
+    WavAudioSink::~WavAudioSink() {
+        if (file_.is_open()) {
+            file_.seekp(0);
+            write_header();
+        }
+    }
+    void WavAudioSink::Push(const int16_t* samples, size_t frames) {
+        size_t bytes = frames * channels_ * sizeof(int16_t);
+        file_.write(reinterpret_cast<const char*>(samples), bytes);
+        data_bytes_ += bytes;
+    }
+    void WavAudioSink::write_header() {
+        auto put16 = [this](uint16_t value) {
+            file_.put(value & 0xFF).put(value >> 8);
+        };
+        auto put32 = [&put16](uint32_t value) {
+            put16(value & 0xFFFF);
+            put16(value >> 16);
+        };
+        uint16_t block_align = channels_ * sizeof(int16_t);
+        file_.write("RIFF", 4);
+        put32(36 + data_bytes_);
+        file_.write("WAVEfmt ", 8);
+        put32(16);
+        // PCM
+        put16(1);
+        put16(channels_);
+        put32(sample_rate_);
+        put32(sample_rate_ * block_align);
+        put16(block_align);
+        put16(16);
+        file_.write("data", 4);
+        put32(data_bytes_);
+    }
+    SDLAudioSink::SDLAudioSink(int sample_rate, int channels, int device_frames) :
+            AudioSink(sample_rate, channels),
+            device_frames_(device_frames),
+            ring_(device_frames * channels * 8),
+            last_frame_(channels, 0) {
+        SDL_AudioSpec want;
+        SDL_zero(want);
+        want.freq = sample_rate;
+        want.format = AUDIO_S16SYS;
+        want.channels = channels;
+        want.samples = device_frames;
+        want.callback = callback;
+        want.userdata = this;
+        SDL_AudioSpec have;
+        // SDL converts if the device can't take this rate or format
+        device_id_ = SDL_OpenAudioDevice(0, 0, &want, &have, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+        if (device_id_ == 0) {
+            SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Failed to open audio: %s", SDL_GetError());
+            return;
+        }
+        device_frames_ = have.samples;
+        SDL_PauseAudioDevice(device_id_, 0);
+    }
+    SDLAudioSink::~SDLAudioSink() {
+        if (device_id_ != 0) {
+            SDL_CloseAudioDevice(device_id_);
+        }
+    }
+    void SDLAudioSink::Push(const int16_t* samples, size_t frames) {
+        // Samples that don't fit are dropped, the emulator is ahead of the device
+        ring_.Push(samples, frames * channels_);
+    }
+    double SDLAudioSink::GetFillLevel() {
+        return static_cast<double>(ring_.GetSize()) / ring_.GetCapacity();
+    }
+    void SDLAudioSink::Clear() {
+        SDL_LockAudioDevice(device_id_);
+        ring_.Clear();
+        SDL_UnlockAudioDevice(device_id_);
+    }
+    void SDLAudioSink::callback(void* userdata, uint8_t* stream, int len) {
+        auto* sink = static_cast<SDLAudioSink*>(userdata);
+        int16_t* out = reinterpret_cast<int16_t*>(stream);
+        size_t count = len / sizeof(int16_t);
+        size_t popped = sink->ring_.Pop(out, count);
+        size_t channels = sink->channels_;
+        if (popped >= channels) {
+            std::copy_n(out + popped - channels, channels, sink->last_frame_.begin());
+        }
+        // Holding the last frame on underruns avoids a click
+        for (size_t i = popped; i < count; i++) {
+            out[i] = sink->last_frame_[i % channels];
+        }
+    }
+}
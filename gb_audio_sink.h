@@ -0,0 +1,111 @@
+#pragma once
+#ifndef TKP_GB_AUDIO_SINK_H
+#define TKP_GB_AUDIO_SINK_H
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+namespace TKPEmu::Gameboy::Devices {
+    // Lock-free ring buffer of samples for one producer and one consumer thread
+    class SampleRing {
+    public:
+        // Capacity is rounded up to a power of two
+        explicit SampleRing(size_t capacity);
+        // Both return how many samples were actually pushed or popped
+        size_t Push(const int16_t* samples, size_t count);
+        size_t Pop(int16_t* samples, size_t count);
+        size_t GetSize() const;
+        size_t GetCapacity() const { return buffer_.size(); }
+        // Only safe while the consumer isn't running
+        void Clear();
+    private:
+        std::vector<int16_t> buffer_;
+        size_t mask_;
+        // Kept on separate cache lines so the two threads don't false share
+        alignas(64) std::atomic<size_t> write_ = 0;
+        alignas(64) std::atomic<size_t> read_ = 0;
+    };
+    // Receives the samples generated by the APU. Samples are signed 16-bit and
+    // interleaved, counts are in frames (one sample per channel)
+    class AudioSink {
+    public:
+        AudioSink(int sample_rate, int channels) : sample_rate_(sample_rate), channels_(channels) {}
+        virtual ~AudioSink() = default;
+        virtual void Push(const int16_t* samples, size_t frames) = 0;
+        // How full the buffer of a real-time sink is, from 0 to 1. The APU
+        // produces slightly more or fewer samples to keep it half full, sinks
+        // that don't play in real time stay at half so the rate never changes
+        virtual double GetFillLevel() { return 0.5; }
+        // Sinks that play the samples as they come, these can't keep up with
+        // emulation running faster than the hardware
+        virtual bool IsRealTime() { return false; }
+        // Drops the samples that haven't been played yet
+        virtual void Clear() {}
+        int GetSampleRate() { return sample_rate_; }
+        int GetChannels() { return channels_; }
+    protected:
+        int sample_rate_;
+        int channels_;
+    };
+    // Discards everything, for measuring synthesis without any output
+    class NullAudioSink final : public AudioSink {
+    public:
+        using AudioSink::AudioSink;
+        void Push(const int16_t*, size_t) override {}
+    };
+    // Hashes every second of audio separately, so a difference can be traced
+    // to when it started. Only the hashes are kept, not the samples
+    class HashAudioSink final : public AudioSink {
+    public:
+        using AudioSink::AudioSink;
+        void Push(const int16_t* samples, size_t frames) override;
+        // FNV-1a of each finished second
+        const std::vector<uint32_t>& GetSecondHashes() { return second_hashes_; }
+        // Of the second that isn't finished yet
+        uint32_t GetCurrentHash() { return hash_; }
+        // The hex hashes of every second joined by '-', including the
+        // unfinished one if it has any samples
+        std::string GetHashString();
+    private:
+        static constexpr uint32_t FNV_OFFSET = 0x811C9DC5;
+        static constexpr uint32_t FNV_PRIME = 0x01000193;
+        std::vector<uint32_t> second_hashes_;
+        uint32_t hash_ = FNV_OFFSET;
+        size_t second_frames_ = 0;
+    };
+    // Writes a 16-bit PCM wav file, the sizes in the header are filled in when
+    // the sink is destroyed
+    class WavAudioSink final : public AudioSink {
+    public:
+        WavAudioSink(const std::string& path, int sample_rate, int channels);
+        ~WavAudioSink();
+        bool IsOpen() { return file_.is_open(); }
+        void Push(const int16_t* samples, size_t frames) override;
+    private:
+        std::ofstream file_;
+        uint32_t data_bytes_ = 0;
+        void write_header();
+    };
+    // Plays on an SDL audio device. The device callback pulls samples from a
+    // ring buffer and repeats the last frame when it runs dry
+    class SDLAudioSink final : public AudioSink {
+    public:
+        SDLAudioSink(int sample_rate, int channels, int device_frames = 512);
+        ~SDLAudioSink();
+        bool IsOpen() { return device_id_ != 0; }
+        void Push(const int16_t* samples, size_t frames) override;
+        double GetFillLevel() override;
+        bool IsRealTime() override { return true; }
+        void Clear() override;
+        size_t GetQueuedFrames() { return ring_.GetSize() / channels_; }
+    private:
+        uint32_t device_id_ = 0;
+        int device_frames_;
+        SampleRing ring_;
+        // Only touched by the device callback
+        std::vector<int16_t> last_frame_;
+        static void callback(void* userdata, uint8_t* stream, int len);
+    };
+}
+#endif
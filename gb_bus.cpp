@@ -5,6 +5,9 @@
 #include <iostream>
 #include <filesystem>
 #include <GameboyTKP/gb_bus.h>
+#include <GameboyTKP/gb_timer.h>
+#include <GameboyTKP/gb_ppu.h>
+#include <GameboyTKP/gb_state.h>
 #include <GameboyTKP/gb_addresses.h>
 namespace TKPEmu::Gameboy::Devices {
     using RamBank = std::array<uint8_t, 0x2000>;
@@ -12,7 +15,7 @@ namespace TKPEmu::Gameboy::Devices {
 			: channel_array_ptr_(channel_array_ptr)
 	{
 		(*channel_array_ptr_)[2].LengthInit = 256;
-		
+		resize_page_versions();
 	}
 	Bus::~Bus() {
 		battery_save();
@@ -374,8 +377,13 @@ namespace TKPEmu::Gameboy::Devices {
 					case CartridgeType::MBC2_BATTERY: {
 						if (ram_enabled_) {
 							auto sel = (banking_mode_ ? selected_ram_bank_ : 0) % cartridge_.GetRamSize();
-							(ram_banks_[sel])[address % 0x200] |= 0b1111'0000;
-							return (ram_banks_[sel])[address % 0x200];
+							uint8_t& data = (ram_banks_[sel])[address % 0x200];
+							// The upper bits don't exist and read as set
+							if ((data & 0b1111'0000) != 0b1111'0000) {
+								data |= 0b1111'0000;
+								track_write(&data);
+							}
+							return data;
 						} else {
 							unused_mem_area_ = 0xFF;
 							return unused_mem_area_;
@@ -452,6 +460,19 @@ namespace TKPEmu::Gameboy::Devices {
 				}
 				return action_key_mode_ ? ActionKeys : DirectionKeys;
 			}
+			case addr_div:
+			case addr_tim: {
+				SyncTimer();
+				break;
+			}
+			case addr_sta:
+			case addr_lly: {
+				SyncPPU();
+				break;
+			}
+		}
+		if (address >= 0xFE00 && address <= 0xFE9F) {
+			SyncPPU();
 		}
 		unused_mem_area_ = 0xFF;
 		uint8_t read = fast_redirect_address(address);
@@ -485,6 +506,9 @@ namespace TKPEmu::Gameboy::Devices {
 		} else {
 			TIMAChanged = false;
 			TMAChanged = false;
+			if (address >= addr_NR10 && address < addr_wav + 0x10) {
+				SyncAPU();
+			}
 			if (!SoundEnabled) {
 				if (address >= addr_NR10 && address <= addr_NR51) {
 					// When sound is disabled, ignore writes
@@ -685,18 +709,22 @@ namespace TKPEmu::Gameboy::Devices {
 					break;
 				}
 				case addr_div: {
+					SyncTimer();
 					DIVReset = true;
 					break;
 				}
 				case addr_tac: {
+					SyncTimer();
 					data |= 0b1111'1000;
 					break;
 				}
 				case addr_tim: {
+					SyncTimer();
 					TIMAChanged = true;
 					break;
 				}
 				case addr_tma: {
+					SyncTimer();
 					TMAChanged = true;
 					break;
 				}
@@ -792,6 +820,7 @@ namespace TKPEmu::Gameboy::Devices {
 					break;
 				}
 				case addr_NR32: {
+					(*channel_array_ptr_)[2].WaveOutputLevel = (data >> 5) & 0b11;
 					data |= 0b1001'1111;
 					break;
 				}
@@ -845,6 +874,7 @@ namespace TKPEmu::Gameboy::Devices {
 						ch.RightVolume = data & 0b111;
 						ch.LeftVolume = (data >> 4) & 0b111;
 					}
+					break;
 				}
 				case addr_NR51: {
 					#pragma GCC unroll 4
@@ -889,7 +919,59 @@ namespace TKPEmu::Gameboy::Devices {
 					break;
 				}
 			}
-			fast_redirect_address(address) = data;
+			uint8_t& target = fast_redirect_address(address);
+			if (address < 0xFE00) {
+				target = data;
+				track_write(&target);
+			} else if (&target >= oam_.data() && &target < oam_.data() + oam_.size()) {
+				// Rewriting the same byte keeps the sprite cache
+				if (target != data) {
+					target = data;
+					++OamVersion;
+				}
+			} else {
+				target = data;
+			}
+		}
+	}
+	void Bus::track_write(const uint8_t* target) {
+		// Writes that land outside of the tracked memory (blocked VRAM, no
+		// cartridge RAM, RTC registers) don't match any of these
+		auto offset = [target](const void* base) {
+			return reinterpret_cast<uintptr_t>(target) - reinterpret_cast<uintptr_t>(base);
+		};
+		size_t page;
+		if (size_t wram = offset(wram_banks_.data()); wram < sizeof(wram_banks_)) {
+			page = wram / PAGE_SIZE;
+		} else if (size_t vram = offset(vram_banks_.data()); vram < sizeof(vram_banks_)) {
+			page = (sizeof(wram_banks_) + vram) / PAGE_SIZE;
+			++VramVersion;
+			if (vram % 0x2000 < 0x1800) {
+				++TileVersions[(vram / 0x2000) * 384 + (vram % 0x2000) / 16];
+			}
+		} else if (size_t ram = offset(ram_banks_.data()); ram < ram_banks_.size() * sizeof(RamBank)) {
+			page = (sizeof(wram_banks_) + sizeof(vram_banks_) + ram) / PAGE_SIZE;
+		} else {
+			return;
+		}
+		++PageVersions[page];
+	}
+	const uint8_t* Bus::GetPage(size_t page) {
+		size_t offset = page * PAGE_SIZE;
+		if (offset < sizeof(wram_banks_)) {
+			return reinterpret_cast<const uint8_t*>(wram_banks_.data()) + offset;
+		}
+		offset -= sizeof(wram_banks_);
+		if (offset < sizeof(vram_banks_)) {
+			return reinterpret_cast<const uint8_t*>(vram_banks_.data()) + offset;
+		}
+		offset -= sizeof(vram_banks_);
+		return reinterpret_cast<const uint8_t*>(ram_banks_.data()) + offset;
+	}
+	void Bus::resize_page_versions() {
+		PageVersions.resize((sizeof(wram_banks_) + sizeof(vram_banks_) + ram_banks_.size() * sizeof(RamBank)) / PAGE_SIZE);
+		for (auto& version : PageVersions) {
+			++version;
 		}
 	}
 	void Bus::WriteL(uint16_t address, uint16_t data) {
@@ -899,6 +981,21 @@ namespace TKPEmu::Gameboy::Devices {
 	void Bus::ClearNR52Bit(uint8_t bit) {
 		redirect_address(addr_NR52) &= ~(1 << bit);
 	}
+	void Bus::SyncAPU() {
+		if (apu_) {
+			apu_->Sync();
+		}
+	}
+	void Bus::SyncTimer() {
+		if (timer_) {
+			timer_->Sync();
+		}
+	}
+	void Bus::SyncPPU() {
+		if (ppu_) {
+			ppu_->CatchUp();
+		}
+	}
 	void Bus::Reset() {
 		SoftReset();
 		for (auto& rom : rom_banks_) {
@@ -915,6 +1012,14 @@ namespace TKPEmu::Gameboy::Devices {
 		oam_.fill(0);
 		vram_banks_[0].fill(0);
 		vram_banks_[1].fill(0);
+		++VramVersion;
+		++OamVersion;
+		for (auto& version : TileVersions) {
+			++version;
+		}
+		for (auto& version : PageVersions) {
+			++version;
+		}
 		DirectionKeys = 0b1110'1111;
         ActionKeys = 0b1101'1111;
 		selected_rom_bank_ = 1;
@@ -923,6 +1028,65 @@ namespace TKPEmu::Gameboy::Devices {
 		vram_sel_bank_ = UseCGB;
 		BiosEnabled = true;
 	}
+	template<class Archive>
+	void Bus::Serialize(Archive& archive) {
+		archive(BiosEnabled, UseCGB, SoundEnabled, DIVReset, TMAChanged, TIMAChanged, WriteToVram, OAMAccessible, CurScanlineX);
+		archive(selected_ram_bank_, selected_rom_bank_, selected_rom_bank_high_, ram_enabled_, rtc_enabled_, banking_mode_, action_key_mode_);
+		archive(dma_transfer_, dma_setup_, dma_fresh_bug_, dma_index_, dma_offset_, dma_new_offset_);
+		archive(hdma_source_, hdma_dest_, hdma_index_, hdma_size_, hdma_transfer_, hdma_remaining_, use_gdma_);
+		archive(bg_palette_auto_increment_, bg_palette_index_, obj_palette_auto_increment_, obj_palette_index_, BGPalettes, OBJPalettes);
+		archive(vram_sel_bank_, wram_sel_bank_, unused_mem_area_);
+		decltype(oam_) old_oam;
+		if constexpr (Archive::Loading) {
+			old_oam = oam_;
+		}
+		archive(hram_, eram_default_, oam_, bg_cram_, obj_cram_);
+		if constexpr (Archive::Loading) {
+			// Changes recorded for the scanline in progress are lost
+			ScanlineChanges.clear();
+			fill_fast_map();
+			refill_fast_map_rom();
+			refill_fast_map_wram();
+			if (oam_ != old_oam) {
+				++OamVersion;
+			}
+		}
+	}
+	TKP_GB_SERIALIZE_INSTANTIATE(Bus)
+	template<class Archive>
+	void Bus::SerializeMemory(Archive& archive) {
+		if constexpr (Archive::Loading) {
+			// Only what differs counts as written, so the versions of the rest
+			// stay valid. Compared a page then a tile at a time
+			auto load = [&](void* memory, size_t size) {
+				auto* bytes = static_cast<uint8_t*>(memory);
+				std::array<uint8_t, PAGE_SIZE> page;
+				for (size_t i = 0; i < size; i += PAGE_SIZE) {
+					archive(page);
+					if (std::equal(page.begin(), page.end(), bytes + i)) {
+						continue;
+					}
+					for (size_t j = 0; j < PAGE_SIZE; j += 16) {
+						if (!std::equal(&page[j], &page[j] + 16, bytes + i + j)) {
+							std::copy(&page[j], &page[j] + 16, bytes + i + j);
+							track_write(bytes + i + j);
+						}
+					}
+				}
+			};
+			load(wram_banks_.data(), sizeof(wram_banks_));
+			load(vram_banks_.data(), sizeof(vram_banks_));
+			load(ram_banks_.data(), ram_banks_.size() * sizeof(RamBank));
+		} else {
+			archive(wram_banks_, vram_banks_);
+			// Same count as the cartridge the state is loaded into, the layout check
+			// rejects it otherwise
+			for (auto& bank : ram_banks_) {
+				archive(bank);
+			}
+		}
+	}
+	TKP_GB_SERIALIZE_INSTANTIATE_FUNCTION(Bus::SerializeMemory)
 	Cartridge& Bus::GetCartridge() {
 		return cartridge_;
 	}
@@ -950,11 +1114,25 @@ namespace TKPEmu::Gameboy::Devices {
 		}
 		BiosEnabled = true;
 		UseCGB = cartridge_.UseCGB;
+		resize_page_versions();
 		SoftReset();
 		if (ret)
 			fill_fast_map();
 		return ret;
 	}
+	void Bus::CopyCartridge(const Bus& other) {
+		Reset();
+		cartridge_ = other.cartridge_;
+		rom_banks_ = other.rom_banks_;
+		ram_banks_ = other.ram_banks_;
+		rom_banks_size_ = other.rom_banks_size_;
+		curr_save_file_.clear();
+		BiosEnabled = true;
+		UseCGB = other.UseCGB;
+		resize_page_versions();
+		SoftReset();
+		fill_fast_map();
+	}
 	void Bus::TransferDMA(uint8_t clk) {
 		if (dma_transfer_) {
 			int times = clk / 4;
@@ -964,8 +1142,14 @@ namespace TKPEmu::Gameboy::Devices {
 					uint16_t source = dma_offset_ | index;
 					bool old = OAMAccessible;
 					OAMAccessible = true;
-					oam_[index] = Read(source);	
+					uint8_t value = Read(source);
 					OAMAccessible = old;
+					// Games copy the same sprites every frame, only a change
+					// invalidates the sprite cache
+					if (oam_[index] != value) {
+						oam_[index] = value;
+						++OamVersion;
+					}
 				} else {
 					dma_transfer_ = false;
 					dma_fresh_bug_ = false;
@@ -996,7 +1180,7 @@ namespace TKPEmu::Gameboy::Devices {
 		}
 	}
 	void Bus::battery_save() {
-		if (cartridge_.UsingBattery()) {
+		if (cartridge_.UsingBattery() && !curr_save_file_.empty()) {
 			std::ofstream of(curr_save_file_, std::ios::binary);
 			if (cartridge_.GetRamSize() != 0) {
 				for (int i = 0; i < cartridge_.GetRamSize(); ++i) {
@@ -1024,7 +1208,7 @@ namespace TKPEmu::Gameboy::Devices {
 				ClearNR52Bit(channel_no);
 			}
 		}
-		if (channel_no < 2) {
+		if (channel_no < 3) {
 			chan.Frequency &= 0b0000'1111'1111;
 			chan.Frequency |= (data & 0b111) << 8;
 			chan.ShadowFrequency = chan.Frequency;
@@ -1041,6 +1225,11 @@ namespace TKPEmu::Gameboy::Devices {
 			if (chan.DACEnabled) {
 				redirect_address(addr_NR52) |= 1 << channel_no;
 			}
+			if (channel_no == 2) {
+				// Wave channel restarts from the first sample
+				chan.WaveDutyPosition = 0;
+				chan.FrequencyTimer = (2048 - chan.Frequency) * 2;
+			}
 		}
 		data |= 0b1011'1111;
 	}
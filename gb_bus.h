@@ -27,6 +27,7 @@ namespace TKPEmu::Gameboy::Devices {
 	};
     using PaletteColors = std::array<uint16_t, 4>;
     class PPU;
+    class Timer;
     class Bus {
     private:
         using RamBank = std::array<uint8_t, 0x2000>;
@@ -40,16 +41,43 @@ namespace TKPEmu::Gameboy::Devices {
         uint16_t ReadL(uint16_t address);
         uint8_t& GetReference(uint16_t address);
         void ClearNR52Bit(uint8_t bit);
+        // Runs the APU channels up to now, before their state changes
+        void SyncAPU();
+        // Brings DIV and TIMA up to date, before a timer register is accessed
+        void SyncTimer();
+        // Runs the PPU up to the M-cycle of a CPU read of STAT, LY or OAM
+        void SyncPPU();
         void Write(uint16_t address, uint8_t data);
         void WriteL(uint16_t address, uint16_t data);
         void TransferDMA(uint8_t clk);
         void TransferHDMA();
         void Reset();
         void SoftReset();
+        // Lists the state saved in save states, see gb_state.h. The ROM, the
+        // boot ROMs and the keys held on the host aren't part of it
+        template<class Archive>
+        void Serialize(Archive& archive);
+        // WRAM, VRAM and cartridge RAM, saved in their own section so their
+        // pages sit at fixed offsets in a state
+        template<class Archive>
+        void SerializeMemory(Archive& archive);
         std::vector<RamBank>& GetRamBanks();
         Cartridge& GetCartridge();
         bool LoadCartridge(std::string filename);
-        std::array<std::array<uint8_t, 3>, 4> Palette;
+        // Loads the cartridge another bus has loaded, without its save file
+        // so the copy never writes the battery
+        void CopyCartridge(const Bus& other);
+        std::array<std::array<uint8_t, 3>, 4> Palette{};
+        // Memory is tracked in pages of this size
+        static constexpr size_t PAGE_SIZE = 0x100;
+        // Bumped on every write to a page of the memory SerializeMemory saves,
+        // in the same order, and when a loaded state changes the page. All of
+        // them are bumped when the memory is changed any other way
+        std::vector<uint32_t> PageVersions;
+        // Index of the first of the 64 VRAM pages, bank 0 first
+        static constexpr size_t VRAM_FIRST_PAGE = 0x8000 / PAGE_SIZE;
+        // The memory of a page of PageVersions
+        const uint8_t* GetPage(size_t page);
         std::unordered_map<uint8_t, Change> ScanlineChanges;
         std::array<PaletteColors, 8> BGPalettes{};
         std::array<PaletteColors, 8> OBJPalettes{};
@@ -63,6 +91,12 @@ namespace TKPEmu::Gameboy::Devices {
         uint8_t DirectionKeys = 0b1110'1111;
         uint8_t ActionKeys = 0b1101'1111;
         uint8_t CurScanlineX = 0;
+        // Incremented on every write that lands in VRAM
+        uint64_t VramVersion = 0;
+        // Incremented on every OAM write that changes a byte, including DMA and loads
+        uint64_t OamVersion = 0;
+        // Incremented on every write that lands in a tile, indexed by bank * 384 + tile number
+        std::array<uint32_t, 768> TileVersions{};
         uint8_t selected_ram_bank_ = 0;
         uint8_t selected_rom_bank_ = 1;
         uint8_t selected_rom_bank_high_ = 0;
@@ -100,6 +134,7 @@ namespace TKPEmu::Gameboy::Devices {
         std::array<uint8_t, 0x2000> eram_default_{};
         std::array<std::array<uint8_t, 0x1000>, 8> wram_banks_{};
         std::array<std::array<uint8_t, 0x2000>, 2> vram_banks_{};
+        static_assert(sizeof(wram_banks_) == VRAM_FIRST_PAGE * PAGE_SIZE);
         std::array<uint8_t, 0xA0> oam_{};
         std::array<uint8_t, 0x40> bg_cram_{};
         std::array<uint8_t, 0x40> obj_cram_{};
@@ -109,12 +144,17 @@ namespace TKPEmu::Gameboy::Devices {
         bool dmg_bios_loaded_ = false;
         bool cgb_bios_loaded_ = false;
         ChannelArrayPtr channel_array_ptr_;
+        APU* apu_ = nullptr;
+        Timer* timer_ = nullptr;
+        PPU* ppu_ = nullptr;
         uint8_t& redirect_address(uint16_t address);
         uint8_t& fast_redirect_address(uint16_t address);
         void fill_fast_map();
         inline void refill_fast_map_rom();
         inline void refill_fast_map_vram();
         inline void refill_fast_map_wram();
+        void track_write(const uint8_t* target);
+        void resize_page_versions();
 
         void handle_mbc(uint16_t address, uint8_t data);
         void battery_save();
@@ -125,6 +165,7 @@ namespace TKPEmu::Gameboy::Devices {
         void disable_dac(int channel_no);
 
         friend class PPU;
+        friend class PixelFifo;
         friend class TKPEmu::Gameboy::Gameboy_TKPWrapper;
     };
 }
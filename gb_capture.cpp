@@ -0,0 +1,175 @@
+#include <GameboyTKP/gb_capture.h>
+#include <cstring>
+namespace TKPEmu::Gameboy::Utils {
+	constexpr uint32_t CAPTURE_WIDTH = 160;
+	constexpr uint32_t CAPTURE_HEIGHT = 144;
+	enum QOIOp {
+		QOI_OP_INDEX = 0x00,
+		QOI_OP_DIFF = 0x40,
+		QOI_OP_LUMA = 0x80,
+		QOI_OP_RUN = 0xC0,
+		QOI_OP_RGB = 0xFE,
+	};
+	FrameCapture::FrameCapture(const std::string& path, ScreenFormat format, size_t slots) :
+		file_(path, std::ios::binary),
+		format_(format)
+	{
+		size_t bytes_per_pixel = format == ScreenFormat::RGBA8888 ? 4 : 2;
+		frame_size_ = CAPTURE_WIDTH * CAPTURE_HEIGHT * bytes_per_pixel;
+		slots_.resize(slots);
+		for (size_t i = 0; i < slots; i++) {
+			slots_[i].resize(frame_size_);
+			free_slots_.push(i);
+		}
+		// Worst case of 4 bytes per pixel plus the header and end marker
+		encoded_.reserve(14 + CAPTURE_WIDTH * CAPTURE_HEIGHT * 4 + 8);
+		encoder_ = std::thread(&FrameCapture::encode_worker, this);
+	}
+	FrameCapture::~FrameCapture() {
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			stop_ = true;
+		}
+		queued_cv_.notify_one();
+		encoder_.join();
+	}
+	void FrameCapture::Push(const uint8_t* frame) {
+		size_t slot;
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			if (free_slots_.empty()) {
+				++dropped_frames_;
+				return;
+			}
+			slot = free_slots_.front();
+			free_slots_.pop();
+		}
+		// The slot belongs to this thread until it's queued
+		std::memcpy(slots_[slot].data(), frame, frame_size_);
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			queued_slots_.push(slot);
+		}
+		queued_cv_.notify_one();
+	}
+	uint64_t FrameCapture::GetWrittenFrames() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		return written_frames_;
+	}
+	uint64_t FrameCapture::GetDroppedFrames() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		return dropped_frames_;
+	}
+	void FrameCapture::encode_worker() {
+		while (true) {
+			size_t slot;
+			{
+				std::unique_lock<std::mutex> lk(mutex_);
+				queued_cv_.wait(lk, [this]() {
+					return stop_ || !queued_slots_.empty();
+				});
+				if (queued_slots_.empty()) {
+					// Stopped and every queued frame is written
+					break;
+				}
+				slot = queued_slots_.front();
+				queued_slots_.pop();
+			}
+			encode_qoi(slots_[slot].data());
+			file_.write(reinterpret_cast<const char*>(encoded_.data()), encoded_.size());
+			std::lock_guard<std::mutex> lg(mutex_);
+			free_slots_.push(slot);
+			++written_frames_;
+		}
+		file_.flush();
+	}
+	void FrameCapture::read_pixel(const uint8_t* frame, size_t pos, uint8_t* rgb) {
+		switch (format_) {
+			case ScreenFormat::RGBA8888: {
+				std::memcpy(rgb, &frame[pos * 4], 3);
+				break;
+			}
+			case ScreenFormat::RGB565: {
+				uint16_t color;
+				std::memcpy(&color, &frame[pos * 2], 2);
+				uint8_t red = color >> 11, green = (color >> 5) & 0b111111, blue = color & 0b11111;
+				rgb[0] = (red << 3) | (red >> 2);
+				rgb[1] = (green << 2) | (green >> 4);
+				rgb[2] = (blue << 3) | (blue >> 2);
+				break;
+			}
+			case ScreenFormat::RGB555: {
+				uint16_t color;
+				std::memcpy(&color, &frame[pos * 2], 2);
+				uint8_t red = (color >> 10) & 0b11111, green = (color >> 5) & 0b11111, blue = color & 0b11111;
+				rgb[0] = (red << 3) | (red >> 2);
+				rgb[1] = (green << 3) | (green >> 2);
+				rgb[2] = (blue << 3) | (blue >> 2);
+				break;
+			}
+			case ScreenFormat::Indexed: {
+				break;
+			}
+		}
+	}
+	// Alpha is always 255, so the RGBA ops of the format are never needed
+	void FrameCapture::encode_qoi(const uint8_t* frame) {
+		encoded_.clear();
+		auto put32 = [this](uint32_t value) {
+			for (int shift = 24; shift >= 0; shift -= 8) {
+				encoded_.push_back(value >> shift);
+			}
+		};
+		encoded_.insert(encoded_.end(), { 'q', 'o', 'i', 'f' });
+		put32(CAPTURE_WIDTH);
+		put32(CAPTURE_HEIGHT);
+		// 3 channels, sRGB
+		encoded_.push_back(3);
+		encoded_.push_back(0);
+		// Previously seen pixels as packed RGBA, the alpha of 0 keeps the
+		// initial entries from matching any pixel
+		std::array<uint32_t, 64> seen{};
+		std::array<uint8_t, 3> prev = { 0, 0, 0 };
+		int run = 0;
+		for (size_t pos = 0; pos < CAPTURE_WIDTH * CAPTURE_HEIGHT; pos++) {
+			std::array<uint8_t, 3> px;
+			read_pixel(frame, pos, px.data());
+			if (px == prev) {
+				if (++run == 62) {
+					encoded_.push_back(QOI_OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				encoded_.push_back(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			uint8_t hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+			uint32_t packed = (uint32_t(px[0]) << 24) | (px[1] << 16) | (px[2] << 8) | 255;
+			if (seen[hash] == packed) {
+				encoded_.push_back(QOI_OP_INDEX | hash);
+			} else {
+				seen[hash] = packed;
+				int8_t dr = px[0] - prev[0];
+				int8_t dg = px[1] - prev[1];
+				int8_t db = px[2] - prev[2];
+				int8_t dr_dg = dr - dg;
+				int8_t db_dg = db - dg;
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					encoded_.push_back(QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+				} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+					encoded_.push_back(QOI_OP_LUMA | (dg + 32));
+					encoded_.push_back(((dr_dg + 8) << 4) | (db_dg + 8));
+				} else {
+					encoded_.insert(encoded_.end(), { QOI_OP_RGB, px[0], px[1], px[2] });
+				}
+			}
+			prev = px;
+		}
+		if (run > 0) {
+			encoded_.push_back(QOI_OP_RUN | (run - 1));
+		}
+		encoded_.insert(encoded_.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+	}
+}
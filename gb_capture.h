@@ -0,0 +1,50 @@
+#pragma once
+#ifndef TKP_GB_CAPTURE_H
+#define TKP_GB_CAPTURE_H
+#include <GameboyTKP/gb_ppu.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+namespace TKPEmu::Gameboy::Utils {
+	// Streams frames to a file as back to back QOI images (qoiformat.org), every
+	// image is complete with its own header and end marker.
+	// Frames are copied into a fixed number of slots and encoded on a background
+	// thread, when every slot is in use the frame is dropped instead of waiting
+	class FrameCapture {
+	public:
+		using ScreenFormat = TKPEmu::Gameboy::Devices::ScreenFormat;
+		FrameCapture(const std::string& path, ScreenFormat format, size_t slots = 8);
+		// Encodes the frames still queued before returning
+		~FrameCapture();
+		FrameCapture(const FrameCapture&) = delete;
+		FrameCapture& operator=(const FrameCapture&) = delete;
+		bool IsOpen() { return file_.is_open(); }
+		// Indexed frames can't be captured, their colors depend on the palettes
+		static bool IsSupported(ScreenFormat format) { return format != ScreenFormat::Indexed; }
+		void Push(const uint8_t* frame);
+		uint64_t GetWrittenFrames();
+		uint64_t GetDroppedFrames();
+	private:
+		std::ofstream file_;
+		ScreenFormat format_;
+		size_t frame_size_;
+		std::vector<std::vector<uint8_t>> slots_;
+		std::queue<size_t> free_slots_;
+		std::queue<size_t> queued_slots_;
+		std::mutex mutex_;
+		std::condition_variable queued_cv_;
+		uint64_t written_frames_ = 0;
+		uint64_t dropped_frames_ = 0;
+		bool stop_ = false;
+		std::vector<uint8_t> encoded_;
+		std::thread encoder_;
+		void encode_worker();
+		void encode_qoi(const uint8_t* frame);
+		void read_pixel(const uint8_t* frame, size_t pos, uint8_t* rgb);
+	};
+}
+#endif
@@ -161,7 +161,6 @@ namespace TKPEmu::Gameboy::Devices {
 		}
 	}
 	const char* Cartridge::GetHeaderText() {
-		static std::string header_text;
 		if (!text_cached_) {
 			text_cached_ = true;
 			bool cgb = false;
@@ -191,28 +190,28 @@ namespace TKPEmu::Gameboy::Devices {
 				sum = sum - (reinterpret_cast<char*>(&header_))[i] - 1;
 			}
 			std::string check = (sum == header_.headerChecksum) ? "Passed" : "Failed";
-			header_text = "Name:";
-			header_text += name.c_str(); 
-			header_text += "\n";
-			header_text += "Type:";
-			header_text += GetCartridgeTypeName();
-			header_text += "\n";
-			header_text += "Licensee:" + licensee + "\n";
-			header_text += "GBC:";
-			header_text += cgb_type.c_str();
-			header_text += "\n";
-			header_text += "SGB:" + sgb + "\n";
-			header_text += "ROM count:" + std::to_string(header_.romSize) + "\n";
-			header_text += "RAM count:" + std::to_string(header_.ramSize) + "\n";
-			header_text += "Destination:" + dest + "\n";
-			header_text += "Header checksum:";
+			header_text_ = "Name:";
+			header_text_ += name.c_str(); 
+			header_text_ += "\n";
+			header_text_ += "Type:";
+			header_text_ += GetCartridgeTypeName();
+			header_text_ += "\n";
+			header_text_ += "Licensee:" + licensee + "\n";
+			header_text_ += "GBC:";
+			header_text_ += cgb_type.c_str();
+			header_text_ += "\n";
+			header_text_ += "SGB:" + sgb + "\n";
+			header_text_ += "ROM count:" + std::to_string(header_.romSize) + "\n";
+			header_text_ += "RAM count:" + std::to_string(header_.ramSize) + "\n";
+			header_text_ += "Destination:" + dest + "\n";
+			header_text_ += "Header checksum:";
 			std::stringstream ss; ss << "0x" << std::setfill('0') << std::setw(2) << std::hex << (short)header_.headerChecksum;
-			header_text += ss.str();
+			header_text_ += ss.str();
 			// std::format not yet supported by gcc c++20 
 			// header_text += std::format("{:x}", header_.headerChecksum);
-			header_text += " (" + check + ")\n";
+			header_text_ += " (" + check + ")\n";
 		}
-		return header_text.c_str();
+		return header_text_.c_str();
 	}
 	std::string Cartridge::GetLicenseeNew() {
 		uint8_t lic = header_.newLicenseeCode[1];
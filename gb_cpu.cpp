@@ -1,4 +1,5 @@
 #include <GameboyTKP/gb_cpu.h>
+#include <GameboyTKP/gb_state.h>
 #include <cmath>
 #include <iostream>
 
@@ -2288,6 +2289,13 @@ namespace TKPEmu::Gameboy::Devices {
         ime_ = false;
         ime_scheduled_ = false;
     }
+    template<class Archive>
+    void CPU::Serialize(Archive& archive) {
+        archive(A, B, C, D, E, H, L, F, PC, SP);
+        archive(ime_, ime_scheduled_, halt_, halt_bug_, stop_, skip_next_, last_instr_);
+        archive(tTemp, tRemove, TClock, TotalClocks);
+    }
+    TKP_GB_SERIALIZE_INSTANTIATE(CPU)
     int CPU::Update() {
         tTemp = 0;
         tRemove = 0;
@@ -164,6 +164,9 @@ namespace TKPEmu::Gameboy::Devices {
         unsigned long TotalClocks = 0;
         void Reset(bool skip);
         int Update();
+        // Lists the state saved in save states, see gb_state.h
+        template<class Archive>
+        void Serialize(Archive& archive);
         uint8_t GetLastInstr() { return last_instr_; }
         friend class TKPEmu::Gameboy::QA::TestGameboy;
     };
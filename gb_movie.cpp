@@ -0,0 +1,54 @@
+#include <GameboyTKP/gb_movie.h>
+#include <fstream>
+
+namespace TKPEmu::Gameboy::Utils {
+	namespace {
+		constexpr uint32_t MOVIE_MAGIC = 0x564D4247; // GBMV
+		constexpr uint32_t MOVIE_VERSION = 1;
+		struct MovieHeader {
+			uint32_t Magic;
+			uint32_t Version;
+			uint64_t RomHash;
+			uint32_t StateSize;
+			uint32_t FrameCount;
+		};
+	}
+	bool Movie::Save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+		MovieHeader header { MOVIE_MAGIC, MOVIE_VERSION, RomHash, static_cast<uint32_t>(StartState.size()), static_cast<uint32_t>(Keys.size()) };
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(StartState.data()), StartState.size());
+		file.write(reinterpret_cast<const char*>(Keys.data()), Keys.size());
+		return file.good();
+	}
+	bool Movie::Load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file.is_open()) {
+			return false;
+		}
+		size_t size = file.tellg();
+		file.seekg(0);
+		MovieHeader header;
+		if (size < sizeof(header) || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+			return false;
+		}
+		if (header.Magic != MOVIE_MAGIC || header.Version != MOVIE_VERSION ||
+				size != sizeof(header) + header.StateSize + header.FrameCount) {
+			return false;
+		}
+		std::vector<uint8_t> state(header.StateSize);
+		std::vector<uint8_t> keys(header.FrameCount);
+		file.read(reinterpret_cast<char*>(state.data()), state.size());
+		file.read(reinterpret_cast<char*>(keys.data()), keys.size());
+		if (!file) {
+			return false;
+		}
+		RomHash = header.RomHash;
+		StartState = std::move(state);
+		Keys = std::move(keys);
+		return true;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#ifndef TKP_GB_MOVIE_H
+#define TKP_GB_MOVIE_H
+#include <cstdint>
+#include <string>
+#include <vector>
+namespace TKPEmu::Gameboy::Utils {
+	// The keys held in every frame of a recording and the save state it starts
+	// from. Keys change only when a frame starts, so playing the movie from its
+	// state repeats the recording exactly
+	struct Movie {
+		// FNV-1a of the whole ROM
+		uint64_t RomHash = 0;
+		std::vector<uint8_t> StartState;
+		// One byte per frame, the direction keys in the low nibble and the
+		// action keys in the high one. Bits are cleared for held keys, like
+		// in the joypad register
+		std::vector<uint8_t> Keys;
+		// A header, the state, then the keys
+		bool Save(const std::string& path) const;
+		// Returns false and leaves the movie unchanged if the file isn't a
+		// complete movie
+		bool Load(const std::string& path);
+	};
+}
+#endif
@@ -0,0 +1,32 @@
+#include <GameboyTKP/gb_pacer.h>
+#include <thread>
+
+namespace TKPEmu::Gameboy::Utils {
+	FramePacer::FramePacer() {
+		Reset();
+	}
+	void FramePacer::WaitForFrame() {
+		auto now = Clock::now();
+		busy_time_ += now - last_wake_;
+		++frames_;
+		auto deadline = start_ + std::chrono::duration_cast<Clock::duration>(FrameDuration(frames_));
+		if (now - deadline > FrameDuration(MAX_LATE)) {
+			start_ = now;
+			frames_ = 0;
+			last_wake_ = now;
+			return;
+		}
+		if (deadline > now) {
+			std::this_thread::sleep_until(deadline);
+		}
+		last_wake_ = Clock::now();
+		sleep_time_ += last_wake_ - now;
+	}
+	void FramePacer::Reset() {
+		start_ = Clock::now();
+		last_wake_ = start_;
+		frames_ = 0;
+		sleep_time_ = {};
+		busy_time_ = {};
+	}
+}
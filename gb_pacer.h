@@ -0,0 +1,36 @@
+#pragma once
+#ifndef TKP_GB_PACER_H
+#define TKP_GB_PACER_H
+#include <chrono>
+#include <cstdint>
+#include <ratio>
+namespace TKPEmu::Gameboy::Utils {
+	// Keeps real-time emulation at the speed of the hardware. Frames are run as
+	// fast as possible and the thread then sleeps until the next one is due,
+	// instead of spinning on the audio queue
+	class FramePacer {
+	public:
+		// 70224 clocks at 4194304Hz, about 59.73 frames per second
+		using FrameDuration = std::chrono::duration<int64_t, std::ratio<70224, 4194304>>;
+		FramePacer();
+		// Sleeps until the frame that just ran is due. When more than MAX_LATE
+		// frames behind it starts over from now instead of running frames back
+		// to back to catch up
+		void WaitForFrame();
+		// Call after a pause so the lost time isn't made up for
+		void Reset();
+		// Time spent sleeping and running since the last reset
+		std::chrono::nanoseconds GetSleepTime() { return sleep_time_; }
+		std::chrono::nanoseconds GetBusyTime() { return busy_time_; }
+	private:
+		using Clock = std::chrono::steady_clock;
+		static constexpr int MAX_LATE = 4;
+		Clock::time_point start_;
+		Clock::time_point last_wake_;
+		// Frames since start_, deadlines are computed from it so they don't drift
+		uint64_t frames_ = 0;
+		std::chrono::nanoseconds sleep_time_{};
+		std::chrono::nanoseconds busy_time_{};
+	};
+}
+#endif
@@ -1,6 +1,10 @@
 #include <GameboyTKP/gb_ppu.h>
+#include <GameboyTKP/gb_capture.h>
+#include <GameboyTKP/gb_upscaler.h>
+#include <GameboyTKP/gb_state.h>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
 #define c(x) (((x) << 3) | ((x) >> 2))
 namespace TKPEmu::Gameboy::Devices {
 	enum STATMode {
@@ -15,7 +19,9 @@ namespace TKPEmu::Gameboy::Devices {
 		b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
 		return b;
 	}
-	PPU::PPU(Bus& bus, std::mutex* draw_mutex) : bus_(bus), draw_mutex_(draw_mutex),
+	constexpr uint64_t FRAME_FRESH = 0b100;
+	PPU::PPU(Bus& bus) : bus_(bus),
+		fifo_(*this, bus),
 		LCDC(bus.GetReference(0xFF40)),
 		STAT(bus.GetReference(0xFF41)),
 		LYC(bus.GetReference(0xFF45)),
@@ -25,17 +31,62 @@ namespace TKPEmu::Gameboy::Devices {
 		SCX(bus.GetReference(0xFF43)),
 		WY(bus.GetReference(0xFF4A)),
 		WX(bus.GetReference(0xFF4B))
-	{}
+	{
+		for (auto& buffer : screen_buffers_) {
+			buffer.resize(4 * 160 * 144);
+		}
+		back_buffer_ = screen_buffers_[back_index_].data();
+		for (size_t i = 0; i < inline_vram_.size(); i++) {
+			inline_vram_[i] = bus_.GetPage(Bus::VRAM_FIRST_PAGE + i);
+		}
+	}
+	PPU::~PPU() {
+		{
+			std::lock_guard<std::mutex> lg(render_mutex_);
+			stop_workers_ = true;
+		}
+		render_cv_.notify_all();
+		for (auto& worker : render_workers_) {
+			worker.join();
+		}
+	}
+	void PPU::CatchUp() {
+		// The scanline backend is tuned to the late CPU timing
+		if (backend_ != PPUBackend::Fifo || ahead_ != 0)
+			return;
+		Update(4);
+		ahead_ = 4;
+	}
 	void PPU::Update(uint8_t cycles) {
-		static constexpr int clock_max = 456 * 144 + 456 * 10;
-		static int  mode3_extend = 0; // unused for now
-		uint8_t current_mode = STAT & STATFlag::MODE;
+		if (ahead_) [[unlikely]] {
+			cycles = cycles > ahead_ ? cycles - ahead_ : 0;
+			ahead_ = 0;
+			if (cycles == 0)
+				return;
+		}
 		clock_ += cycles;
+		if (clock_ < next_event_ && LY == ly_) [[likely]] {
+			// Nothing changes until the next mode or scanline transition
+			if (LYC == LY) {
+				STAT |= STATFlag::COINCIDENCE;
+			}
+			if (LCDC & LCDCFlag::LCD_ENABLE) [[likely]] {
+				if (drawing_) {
+					bus_.CurScanlineX = clock_ - scanline_x_offset_;
+				}
+				return;
+			}
+		}
+		update_state();
+	}
+	void PPU::update_state() {
+		static constexpr int clock_max = 456 * 144 + 456 * 10;
 		clock_ %= clock_max;
 		auto true_ly = clock_ / 456;
 		if (LY != true_ly) {
 			LY = true_ly;
 			IF |= update_lyc();
+			publish_rendered();
 		}
 		if (LYC == LY) {
 			STAT |= STATFlag::COINCIDENCE;
@@ -45,57 +96,64 @@ namespace TKPEmu::Gameboy::Devices {
 			// Normal scanline
 			auto cur_scanline_clocks = clock_ % 456;
 			// Every scanline takes 456 tclocks
+			if (backend_ == PPUBackend::Fifo && cur_scanline_clocks >= 80 && get_mode() != MODE_HBLANK) {
+				// Mode 3 lasts until the FIFO has shifted out the whole scanline
+				if (get_mode() == MODE_OAM_SCAN) {
+					fifo_.StartLine(clock_ - cur_scanline_clocks + 80);
+				}
+				int length = fifo_.Run(clock_);
+				mode3_extend_ = length < 0 ? 456 : length - 172;
+			}
 			if (cur_scanline_clocks < 80) {
 				// OAM scan
 				bus_.CurScanlineX = -1;
 				if (get_mode() != MODE_OAM_SCAN) {
 					if (enabled)
 						bus_.OAMAccessible = false;
+					inline_settings_ = current_settings();
 					// Load the 10 sprites for this line
-					cur_scanline_sprites_.clear();
-					mode3_extend = 0;
-					for (size_t i = 0; i < (bus_.oam_.size()); i += 4) {
-						//SCX & 7 > 0
-						if (is_sprite_eligible(bus_.oam_[i])) {
-							if (cur_scanline_sprites_.size() < 10) {
-								cur_scanline_sprites_.push_back(i);
-							}
-							// Special behavior for x = 0, lengthens mode 2
-							if (bus_.oam_[i + 1] == 0) {
-								mode3_extend += SCX & 7;
-							}
-						}
-						
-					}
+					scan_oam();
 					// Sprites for this scanline are now scanned
-					IF |= set_mode(MODE_OAM_SCAN);
+					int interrupt = set_mode(MODE_OAM_SCAN);
+					if (!oam_irq_sent_)
+						IF |= interrupt;
+					oam_irq_sent_ = false;
 				}
 				// Scanline changes only matter during pixel draw
 				bus_.ScanlineChanges.clear();
-			} else if (cur_scanline_clocks < (80 + 172 + mode3_extend)) {
+			} else if (cur_scanline_clocks < (80 + 172 + mode3_extend_)) {
 				// TODO: don't really know why the -12 but it seems to pass mealybug test :) Investigate? probably not needed if we impl fifo
 				bus_.CurScanlineX = cur_scanline_clocks - 80 - 12;
 				if (LY == 0) {
 					bus_.CurScanlineX += 4;
 				}
 				if (get_mode() != MODE_DRAW_PIXELS) {
+					// Changes made during OAM scan don't carry over to pixel draw
+					bus_.ScanlineChanges.clear();
 					IF |= set_mode(MODE_DRAW_PIXELS);
 				}
 			} else {
 				if (get_mode() != MODE_HBLANK) {
 					if (enabled)
 						bus_.OAMAccessible = true;
-					auto mod = SCX % 8;
-					if (mod == 0) {
+					IF |= set_mode(MODE_HBLANK);
+					if (backend_ == PPUBackend::Scanline) {
+						auto mod = SCX % 8;
+						if (mod == 0) {
 
-					} else if (mod <= 4) {
-						clock_ += 4;
-					} else {
-						clock_ += 8;
+						} else if (mod <= 4) {
+							clock_ += 4;
+						} else {
+							clock_ += 8;
+						}
+						draw_scanline();
 					}
-					IF |= set_mode(MODE_HBLANK);
-					draw_scanline();
 					bus_.ScanlineChanges.clear();
+				} else if (backend_ == PPUBackend::Fifo && LY < 143 && cur_scanline_clocks >= 452 && !oam_irq_sent_) {
+					// The OAM scan interrupt comes one M-cycle before LY changes
+					oam_irq_sent_ = true;
+					if (STAT & STATFlag::MODE2_INTER)
+						IF |= IFInterrupt::LCDSTAT;
 				}
 			}
 		} else {
@@ -109,17 +167,69 @@ namespace TKPEmu::Gameboy::Devices {
 					IF |= IFInterrupt::LCDSTAT;
 				}
 				IF |= set_mode(MODE_VBLANK);
+				++vblanks_;
 				window_internal_ = 0;
 				window_internal_temp_ = 0;
-				std::lock_guard<std::mutex> lg(*draw_mutex_);
-				std::swap(screen_color_data_, screen_color_data_second_);
-				ReadyToDraw = true;
+				fifo_.StartFrame();
+				if (render_frame_) {
+					if (DeferredRendering && backend_ == PPUBackend::Scanline) {
+						dispatch_frame();
+					} else {
+						publish_frame();
+						ReadyToDraw = true;
+					}
+				}
+				render_frame_ = should_render_next();
 			}
 		}
 		if (!enabled) {
+			publish_rendered();
 			clock_ = 0;
 			STAT &= 0b1111'1100;
 			LY = 0;
+			// Evaluate every call while the LCD is off
+			next_event_ = 0;
+			ly_ = 0;
+			drawing_ = false;
+			oam_irq_sent_ = false;
+			return;
+		}
+		schedule_next_event();
+	}
+	// Finds the clock of the next mode or scanline transition
+	void PPU::schedule_next_event() {
+		int line_start = LY * 456;
+		ly_ = LY;
+		drawing_ = false;
+		if (LY <= 143) {
+			switch (get_mode()) {
+				case MODE_OAM_SCAN: {
+					next_event_ = line_start + 80;
+					break;
+				}
+				case MODE_DRAW_PIXELS: {
+					if (backend_ == PPUBackend::Fifo) {
+						// The FIFO runs on every update until the scanline is done
+						next_event_ = clock_ + 1;
+						break;
+					}
+					next_event_ = line_start + 80 + 172 + mode3_extend_;
+					drawing_ = true;
+					scanline_x_offset_ = line_start + 80 + 12 - (LY == 0 ? 4 : 0);
+					break;
+				}
+				default: {
+					if (backend_ == PPUBackend::Fifo && LY < 143 && !oam_irq_sent_) {
+						next_event_ = line_start + 452;
+						break;
+					}
+					next_event_ = line_start + 456;
+					break;
+				}
+			}
+		} else {
+			// LY changes every scanline during VBlank, the last one wraps the clock
+			next_event_ = line_start + 456;
 		}
 	}
 	bool PPU::is_sprite_eligible(uint8_t sprite_y) {
@@ -133,27 +243,208 @@ namespace TKPEmu::Gameboy::Devices {
 		}
 		return false;
  	}
-	void PPU::Reset() {
-		for (int i = 0; i < (screen_color_data_second_.size() - 4); i += 4) {
-			screen_color_data_second_[i + 0] = bus_.Palette[0][0];
-			screen_color_data_second_[i + 1] = bus_.Palette[0][1];
-			screen_color_data_second_[i + 2] = bus_.Palette[0][2];
-			screen_color_data_second_[i + 3] = 255;
-		}
-		for (int i = 0; i < (screen_color_data_.size() - 4); i += 4) {
-			screen_color_data_[i + 0] = bus_.Palette[0][0];
-			screen_color_data_[i + 1] = bus_.Palette[0][1];
-			screen_color_data_[i + 2] = bus_.Palette[0][2];
-			screen_color_data_[i + 3] = 255;
+	void PPU::scan_oam() {
+		bool use8x16 = LCDC & LCDCFlag::OBJ_SIZE;
+		if (bus_.OamVersion != sprite_cache_oam_version_) {
+			sprite_cache_oam_version_ = bus_.OamVersion;
+			++sprite_cache_generation_;
 		}
+		ScanlineSprites& sprites = sprite_cache_[LY];
+		if (sprites.Generation != sprite_cache_generation_ || sprites.ObjSize != use8x16) {
+			auto& oam = bus_.oam_;
+			sprites.Count = 0;
+			sprites.ZeroXCount = 0;
+			for (uint8_t i = 0; i < oam.size(); i += 4) {
+				if (!is_sprite_eligible(oam[i]))
+					continue;
+				if (sprites.Count < 10) {
+					// On DMG the sprite with the lower X wins, so keep the list sorted by X.
+					// Sprites with equal X stay in OAM order, the renderer draws the list back to front
+					int j = sprites.Count++;
+					if (!UseCGB) {
+						while (j > 0 && oam[sprites.Offsets[j - 1] + 1] > oam[i + 1]) {
+							sprites.Offsets[j] = sprites.Offsets[j - 1];
+							--j;
+						}
+					}
+					sprites.Offsets[j] = i;
+				}
+				// Special behavior for x = 0, lengthens mode 3
+				if (oam[i + 1] == 0) {
+					++sprites.ZeroXCount;
+				}
+			}
+			sprites.Generation = sprite_cache_generation_;
+			sprites.ObjSize = use8x16;
+		}
+		cur_scanline_sprites_ = sprites;
+		mode3_extend_ = sprites.ZeroXCount * (SCX & 7);
+	}
+	void PPU::Reset() {
+		clear_screen();
 		LY = 0x0;
 		LCDC = 0b1001'0001;
 		STAT = 0b1000'0000;
 		clock_ = 0;
-		clock_target_ = 0;
+		next_event_ = 0;
+		ly_ = 0;
+		drawing_ = false;
+		ahead_ = 0;
+		oam_irq_sent_ = false;
+		++sprite_cache_generation_;
+	}
+	template<class Archive>
+	void PPU::Serialize(Archive& archive) {
+		archive(clock_, next_event_, ly_, drawing_, scanline_x_offset_, mode3_extend_, oam_irq_sent_);
+		archive(window_internal_, window_internal_temp_);
+		// The generation only matters to the cache
+		archive(cur_scanline_sprites_.Offsets, cur_scanline_sprites_.Count, cur_scanline_sprites_.ZeroXCount);
+		fifo_.Serialize(archive);
+		// The sprite cache follows Bus::OamVersion, which a load only bumps
+		// when OAM differs
 	}
+	TKP_GB_SERIALIZE_INSTANTIATE(PPU)
 	uint8_t* PPU::GetScreenData() {
-		return &screen_color_data_[0];
+		if (middle_.load(std::memory_order_acquire) & FRAME_FRESH) {
+			uint64_t middle = middle_.exchange(front_index_, std::memory_order_acq_rel);
+			front_index_ = middle & 0b11;
+			front_sequence_ = middle >> 3;
+		}
+		return screen_buffers_[front_index_].data();
+	}
+	void PPU::PresentFrame(PPU& source) {
+		uint64_t sequence = source.front_sequence_;
+		const uint8_t* frame = source.GetScreenData();
+		if (source.front_sequence_ == sequence) {
+			return;
+		}
+		std::copy_n(frame, screen_buffers_[back_index_].size(), back_buffer_);
+		frame_info_[back_index_].LineHashes = source.GetFrameInfo().LineHashes;
+		publish_frame();
+		ReadyToDraw = true;
+	}
+	void PPU::publish_frame() {
+		FrameInfo& info = frame_info_[back_index_];
+		uint64_t hash = 0;
+		for (size_t ly = 0; ly < 144; ly++) {
+			info.DirtyLines[ly] = info.LineHashes[ly] != published_hashes_[ly];
+			hash = (hash ^ info.LineHashes[ly]) * 0x100000001B3ull;
+			hash ^= hash >> 29;
+		}
+		info.Hash = hash;
+		published_hashes_ = info.LineHashes;
+		{
+			std::lock_guard<std::mutex> lg(capture_mutex_);
+			if (capture_) {
+				capture_->Push(back_buffer_);
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lg(upscaler_mutex_);
+			if (upscaler_) {
+				upscaler_->Push(back_buffer_);
+			}
+		}
+		++frame_sequence_;
+		uint64_t middle = middle_.exchange(back_index_ | FRAME_FRESH | (frame_sequence_ << 3), std::memory_order_acq_rel);
+		back_index_ = middle & 0b11;
+		back_buffer_ = screen_buffers_[back_index_].data();
+	}
+	void PPU::hash_line(size_t buffer_index, int ly) {
+		size_t size = 160 * bytes_per_pixel_;
+		const uint8_t* data = screen_buffers_[buffer_index].data() + ly * size;
+		uint64_t hash = 0x9E3779B97F4A7C15ull;
+		// Line sizes are multiples of 8 bytes in every screen format
+		for (size_t i = 0; i < size; i += 8) {
+			uint64_t word;
+			std::memcpy(&word, data + i, sizeof(word));
+			hash = (hash ^ word) * 0xBF58476D1CE4E5B9ull;
+			hash ^= hash >> 31;
+		}
+		frame_info_[buffer_index].LineHashes[ly] = hash;
+	}
+	bool PPU::StartCapture(const std::string& path) {
+		if (!Utils::FrameCapture::IsSupported(screen_format_)) {
+			return false;
+		}
+		auto capture = std::make_unique<Utils::FrameCapture>(path, screen_format_);
+		if (!capture->IsOpen()) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lg(capture_mutex_);
+		capture_ = std::move(capture);
+		return true;
+	}
+	void PPU::StopCapture() {
+		std::unique_ptr<Utils::FrameCapture> capture;
+		{
+			std::lock_guard<std::mutex> lg(capture_mutex_);
+			capture = std::move(capture_);
+		}
+		// Finishes encoding the queued frames outside the lock
+		capture.reset();
+	}
+	bool PPU::EnableUpscaler(Utils::UpscaleFilter filter, int scale) {
+		if (!Utils::Upscaler::IsSupported(screen_format_, filter, scale)) {
+			return false;
+		}
+		std::unique_ptr<Utils::Upscaler> upscaler(new Utils::Upscaler(screen_format_, filter, scale));
+		std::lock_guard<std::mutex> lg(upscaler_mutex_);
+		upscaler_ = std::move(upscaler);
+		return true;
+	}
+	void PPU::DisableUpscaler() {
+		std::unique_ptr<Utils::Upscaler> upscaler;
+		{
+			std::lock_guard<std::mutex> lg(upscaler_mutex_);
+			upscaler = std::move(upscaler_);
+		}
+		upscaler.reset();
+	}
+	void PPU::SetScreenFormat(ScreenFormat format) {
+		wait_for_render();
+		if (format != screen_format_) {
+			// The capture and upscaler work on the format they were started with
+			StopCapture();
+			DisableUpscaler();
+		}
+		screen_format_ = format;
+		switch (format) {
+			case ScreenFormat::RGBA8888: {
+				bytes_per_pixel_ = 4;
+				break;
+			}
+			case ScreenFormat::RGB565:
+			case ScreenFormat::RGB555: {
+				bytes_per_pixel_ = 2;
+				break;
+			}
+			case ScreenFormat::Indexed: {
+				bytes_per_pixel_ = 1;
+				break;
+			}
+		}
+		for (auto& buffer : screen_buffers_) {
+			buffer.resize(bytes_per_pixel_ * 160 * 144);
+			buffer.shrink_to_fit();
+		}
+		back_buffer_ = screen_buffers_[back_index_].data();
+		clear_screen();
+	}
+	void PPU::clear_screen() {
+		wait_for_render();
+		inline_settings_ = current_settings();
+		for (size_t i = 0; i < 160 * 144; i++) {
+			put_pixel(inline_settings_, back_buffer_, i, 0, 0x7FFF);
+		}
+		for (size_t i = 0; i < screen_buffers_.size(); i++) {
+			if (i != back_index_) {
+				screen_buffers_[i] = screen_buffers_[back_index_];
+			}
+			for (int ly = 0; ly < 144; ly++) {
+				hash_line(i, ly);
+			}
+		}
 	}
 	int PPU::set_mode(int mode) {
 		mode &= 0b11;
@@ -179,46 +470,289 @@ namespace TKPEmu::Gameboy::Devices {
 		return 0;
 	}
 
+	bool PPU::should_render_next() {
+		if (RenderOnDemand) {
+			return frame_requested_.exchange(false);
+		}
+		if (frames_skipped_ < FrameSkip) {
+			++frames_skipped_;
+			return false;
+		}
+		frames_skipped_ = 0;
+		return true;
+	}
+
 	void PPU::draw_scanline() {
 		bool enabled = LCDC & LCDCFlag::LCD_ENABLE;
 		if (enabled) {
-			if (UseCGB) {
-				render_tiles();
-			} else if (LCDC & LCDCFlag::BG_ENABLE) {
-				render_tiles();
+			bool window_visible = false;
+			if (UseCGB || (LCDC & LCDCFlag::BG_ENABLE)) {
+				window_visible = update_window_line();
 			}
-			if (LCDC & LCDCFlag::OBJ_ENABLE && DrawSprites) {
-				render_sprites();
+			if (!render_frame_) {
+				// The window line counter still advances on skipped frames
+				return;
 			}
+			if (DeferredRendering) {
+				FrameJob& job = frame_jobs_[recording_job_];
+				if (job.PageTablesUsed == 0 || bus_.VramVersion != recorded_vram_version_) {
+					// VRAM changed since the last recorded line, the lines from here on
+					// read from a new page table
+					snapshot_vram(job);
+					recorded_vram_version_ = bus_.VramVersion;
+				}
+				LineState& line = job.Lines[LY];
+				capture_line(line, window_visible);
+				line.VramIndex = job.PageTablesUsed - 1;
+				job.Recorded[LY] = true;
+			} else {
+				capture_line(inline_line_, window_visible);
+				render_line(inline_line_, inline_vram_, inline_settings_, back_buffer_);
+				hash_line(back_index_, LY);
+			}
+		}
+	}
+	void PPU::capture_line(LineState& line, bool window_visible) {
+		line.LY = LY;
+		line.LCDC = LCDC;
+		line.SCX = SCX;
+		line.SCY = SCY;
+		line.WX = WX;
+		line.WY = WY;
+		line.WindowLine = window_internal_;
+		line.WindowVisible = window_visible;
+		line.SpriteCount = cur_scanline_sprites_.Count;
+		for (size_t i = 0; i < cur_scanline_sprites_.Count; i++) {
+			std::copy_n(&bus_.oam_[cur_scanline_sprites_.Offsets[i]], 4, line.Sprites[i].begin());
+		}
+		line.BGPalettes = bus_.BGPalettes;
+		line.OBJPalettes = bus_.OBJPalettes;
+		line.PaletteChanges.clear();
+		for (auto& [pixel, change] : bus_.ScanlineChanges) {
+			if (pixel < 160 && change.new_bg_pal.has_value()) {
+				line.PaletteChanges.push_back({ pixel, change.new_bg_pal.value() });
+			}
+		}
+		if (line.PaletteChanges.size() > 1) [[unlikely]] {
+			std::sort(line.PaletteChanges.begin(), line.PaletteChanges.end(), [](const auto& lhs, const auto& rhs) {
+				return lhs.first < rhs.first;
+			});
+		}
+	}
+	// Adds a page table for the current VRAM to the job. The first table of a
+	// frame copies every page, the ones after it share the unchanged pages
+	void PPU::snapshot_vram(FrameJob& job) {
+		bool first = job.PageTablesUsed == 0;
+		if (job.PageTables.size() == job.PageTablesUsed) {
+			job.PageTables.emplace_back();
+		}
+		VramPages& table = job.PageTables[job.PageTablesUsed];
+		for (size_t i = 0; i < table.size(); i++) {
+			uint32_t version = bus_.PageVersions[Bus::VRAM_FIRST_PAGE + i];
+			if (!first && version == job.PageVersions[i]) {
+				table[i] = job.PageTables[job.PageTablesUsed - 1][i];
+				continue;
+			}
+			if (job.PageCopies.size() == job.PageCopiesUsed) {
+				job.PageCopies.emplace_back();
+			}
+			auto& copy = job.PageCopies[job.PageCopiesUsed++];
+			std::copy_n(inline_vram_[i], Bus::PAGE_SIZE, copy.begin());
+			table[i] = copy.data();
+			job.PageVersions[i] = version;
+		}
+		++job.PageTablesUsed;
+	}
+	void PPU::render_line(const LineState& line, const VramPages& vram, const RenderSettings& settings, uint8_t* buffer) const {
+		// Background color number of each pixel, bit 7 holds the CGB bg-to-obj priority attribute
+		std::array<uint8_t, 160> bg_line{};
+		if (settings.UseCGB || (line.LCDC & LCDCFlag::BG_ENABLE)) {
+			render_tiles(line, vram, settings, buffer, bg_line);
+		}
+		if (line.LCDC & LCDCFlag::OBJ_ENABLE && settings.DrawSprites) {
+			render_sprites(line, vram, settings, buffer, bg_line);
+		}
+	}
+	void PPU::SetDeferredRendering(bool deferred) {
+		if (deferred == DeferredRendering) {
+			return;
+		}
+		wait_for_render();
+		DeferredRendering = deferred;
+		if (deferred && render_workers_.empty()) {
+			unsigned worker_count = std::clamp(std::thread::hardware_concurrency(), 2u, 5u) - 1;
+			for (unsigned i = 0; i < worker_count; i++) {
+				render_workers_.emplace_back(&PPU::render_worker, this);
+			}
+		}
+		for (auto& job : frame_jobs_) {
+			job.Recorded.fill(false);
+			job.PageTablesUsed = 0;
+			job.PageCopiesUsed = 0;
+		}
+	}
+	void PPU::dispatch_frame() {
+		wait_for_render();
+		FrameJob& job = frame_jobs_[recording_job_];
+		job.Settings = current_settings();
+		job.Buffer = back_buffer_;
+		job.BufferIndex = back_index_;
+		{
+			std::lock_guard<std::mutex> lg(render_mutex_);
+			rendering_job_ = &job;
+			next_line_ = 0;
+			lines_left_ = 144;
+			frame_in_flight_ = true;
+			++render_generation_;
+		}
+		render_cv_.notify_all();
+		// The other job finished rendering in the previous dispatch
+		recording_job_ ^= 1;
+		FrameJob& next = frame_jobs_[recording_job_];
+		next.Recorded.fill(false);
+		next.PageTablesUsed = 0;
+		next.PageCopiesUsed = 0;
+	}
+	void PPU::wait_for_render() {
+		std::unique_lock<std::mutex> lk(render_mutex_);
+		render_done_cv_.wait(lk, [this]() {
+			return !frame_in_flight_ && busy_workers_ == 0;
+		});
+		lk.unlock();
+		publish_rendered();
+	}
+	void PPU::publish_rendered() {
+		// Only the emulation thread clears the flag, and no frame is dispatched
+		// before the last one is published
+		if (frame_rendered_.load(std::memory_order_acquire)) {
+			frame_rendered_.store(false, std::memory_order_relaxed);
+			publish_frame();
+			ReadyToDraw = true;
+		}
+	}
+	RenderSettings PPU::current_settings() {
+		return { UseCGB, DrawBackground, DrawWindow, DrawSprites, SpriteDebugColor, bus_.Palette };
+	}
+	void PPU::render_worker() {
+		uint64_t generation = 0;
+		while (true) {
+			FrameJob* job;
+			{
+				std::unique_lock<std::mutex> lk(render_mutex_);
+				render_cv_.wait(lk, [this, generation]() {
+					return stop_workers_ || render_generation_ != generation;
+				});
+				if (stop_workers_) {
+					return;
+				}
+				generation = render_generation_;
+				job = rendering_job_;
+				++busy_workers_;
+			}
+			int ly;
+			while ((ly = next_line_.fetch_add(1)) < 144) {
+				if (job->Recorded[ly]) {
+					const LineState& line = job->Lines[ly];
+					render_line(line, job->PageTables[line.VramIndex], job->Settings, job->Buffer);
+					hash_line(job->BufferIndex, ly);
+				}
+				if (lines_left_.fetch_sub(1) == 1) {
+					// Last line of the frame, the emulation thread publishes it the
+					// next time it checks
+					std::lock_guard<std::mutex> lg(render_mutex_);
+					frame_rendered_.store(true, std::memory_order_release);
+					frame_in_flight_ = false;
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lg(render_mutex_);
+				--busy_workers_;
+			}
+			render_done_cv_.notify_all();
 		}
 	}
 
-	inline void PPU::render_tiles() {
-		uint16_t tileData = (LCDC & LCDCFlag::BG_TILES) ? 0x8000 : 0x8800;
-		bool unsig = true;
-		if (tileData == 0x8800) {
-			unsig = false;
+	// Writes a pixel to a screen buffer in the selected screen format
+	// In DMG mode index is the shade, in CGB mode cgb_color is the 15-bit color
+	void PPU::put_pixel(const RenderSettings& settings, uint8_t* buffer, size_t pos, uint8_t index, uint16_t cgb_color) const {
+		switch (screen_format_) {
+			case ScreenFormat::RGBA8888: {
+				uint8_t* out = &buffer[pos * 4];
+				if (settings.UseCGB) {
+					out[0] = c(cgb_color & 0b11111);
+					out[1] = c((cgb_color >> 5) & 0b11111);
+					out[2] = c((cgb_color >> 10) & 0b11111);
+				} else {
+					out[0] = settings.Palette[index][0];
+					out[1] = settings.Palette[index][1];
+					out[2] = settings.Palette[index][2];
+				}
+				out[3] = 255;
+				break;
+			}
+			case ScreenFormat::RGB565: {
+				uint16_t color;
+				if (settings.UseCGB) {
+					uint16_t green = (cgb_color >> 5) & 0b11111;
+					color = ((cgb_color & 0b11111) << 11) | (((green << 1) | (green >> 4)) << 5) | ((cgb_color >> 10) & 0b11111);
+				} else {
+					auto& pal = settings.Palette[index];
+					color = ((pal[0] >> 3) << 11) | ((pal[1] >> 2) << 5) | (pal[2] >> 3);
+				}
+				reinterpret_cast<uint16_t*>(buffer)[pos] = color;
+				break;
+			}
+			case ScreenFormat::RGB555: {
+				uint16_t color;
+				if (settings.UseCGB) {
+					color = ((cgb_color & 0b11111) << 10) | (cgb_color & (0b11111 << 5)) | ((cgb_color >> 10) & 0b11111);
+				} else {
+					auto& pal = settings.Palette[index];
+					color = ((pal[0] >> 3) << 10) | ((pal[1] >> 3) << 5) | (pal[2] >> 3);
+				}
+				reinterpret_cast<uint16_t*>(buffer)[pos] = color;
+				break;
+			}
+			case ScreenFormat::Indexed: {
+				buffer[pos] = index;
+				break;
+			}
 		}
+	}
+	// Returns whether the window is visible on this scanline
+	bool PPU::update_window_line() {
 		bool windowEnabled = (LCDC & LCDCFlag::WND_ENABLE && WY <= LY);
 		if (WX >= 166 || WX == 0) {
 			windowEnabled = false;
 		}
-		uint16_t identifierLocationW = (LCDC & LCDCFlag::WND_TILEMAP) ? 0x9C00 : 0x9800;
-		uint16_t identifierLocationB = (LCDC & LCDCFlag::BG_TILEMAP) ? 0x9C00 : 0x9800;
-		uint8_t positionY = LY + SCY;
 		if (windowEnabled) {
 			++window_internal_temp_;
 		} else if (window_internal_temp_) {
 			window_internal_ = window_internal_temp_ - 2;
 		}
+		return windowEnabled;
+	}
+	inline void PPU::render_tiles(const LineState& line, const VramPages& vram, const RenderSettings& settings, uint8_t* buffer, std::array<uint8_t, 160>& bg_line) const {
+		uint16_t tileData = (line.LCDC & LCDCFlag::BG_TILES) ? 0x8000 : 0x8800;
+		bool unsig = true;
+		if (tileData == 0x8800) {
+			unsig = false;
+		}
+		bool windowEnabled = line.WindowVisible;
+		uint16_t identifierLocationW = (line.LCDC & LCDCFlag::WND_TILEMAP) ? 0x9C00 : 0x9800;
+		uint16_t identifierLocationB = (line.LCDC & LCDCFlag::BG_TILEMAP) ? 0x9C00 : 0x9800;
+		uint8_t positionY = line.LY + line.SCY;
 		uint16_t identifierLoc = identifierLocationB;
 		uint16_t tileRow = (((uint8_t)(positionY / 8)) * 32);
+		// DMG palette, mid-scanline writes to BGP replace it from the next pixel on
+		PaletteColors dmg_pal = line.BGPalettes[0];
+		auto change = line.PaletteChanges.begin();
 		for (int pixel = 0; pixel < 160; pixel++) {
-			uint8_t positionX = pixel + SCX;
-			if (windowEnabled && pixel >= (WX - 7)) {
+			uint8_t positionX = pixel + line.SCX;
+			if (windowEnabled && pixel >= (line.WX - 7)) {
 				identifierLoc = identifierLocationW;
-				positionX = pixel - (WX - 7);
-				positionY = LY - WY - (window_internal_ * 4);
+				positionX = pixel - (line.WX - 7);
+				positionY = line.LY - line.WY - (line.WindowLine * 4);
 				tileRow = (((uint8_t)(positionY / 8)) * 32);
 			}
 			uint16_t tileCol = (positionX / 8);
@@ -226,102 +760,77 @@ namespace TKPEmu::Gameboy::Devices {
 			uint16_t tileAddress = identifierLoc + tileRow + tileCol;
 			uint16_t tileLocation = tileData;
 			if (unsig) {
-				tileNumber = bus_.Read(tileAddress);
+				tileNumber = read_vram(vram, 0, tileAddress);
 				tileLocation += tileNumber * 16;
 			} else {
-				tileNumber = static_cast<int8_t>(bus_.Read(tileAddress));
+				tileNumber = static_cast<int8_t>(read_vram(vram, 0, tileAddress));
 				tileLocation += (tileNumber + 128) * 16;
 			}
-			uint8_t line = (positionY % 8) * 2;
-			uint8_t attrib = bus_.vram_banks_[1][(identifierLoc + tileRow + tileCol) % 0x2000];
-			bool vram_banks_bank = UseCGB ? (attrib & 0b1000) : false;
-			bool xFlip = UseCGB ? (attrib & 0b100000) : false;
-			bool yFlip = UseCGB ? (attrib & 0b1000000) : false;
+			uint8_t row = (positionY % 8) * 2;
+			uint8_t attrib = read_vram(vram, 1, tileAddress);
+			bool vram_banks_bank = settings.UseCGB ? (attrib & 0b1000) : false;
+			bool xFlip = settings.UseCGB ? (attrib & 0b100000) : false;
+			bool yFlip = settings.UseCGB ? (attrib & 0b1000000) : false;
 			if (yFlip) {
-				line = 14 - line;
+				row = 14 - row;
 			}
-			uint8_t data1 = bus_.vram_banks_[vram_banks_bank][(tileLocation + line) % 0x2000];
-			uint8_t data2 = bus_.vram_banks_[vram_banks_bank][(tileLocation + line + 1) % 0x2000];
+			uint8_t data1 = read_vram(vram, vram_banks_bank, tileLocation + row);
+			uint8_t data2 = read_vram(vram, vram_banks_bank, tileLocation + row + 1);
 			if (xFlip) {
 				data1 = reverse(data1);
 				data2 = reverse(data2);
 			}
 			int colorBit = -((positionX % 8) - 7);
 			int colorNum = (((data2 >> colorBit) & 0b1) << 1) | ((data1 >> colorBit) & 0b1);
-			int idx = (pixel * 4) + (LY * 4 * 160);
-			PaletteColors& bg_ref = UseCGB ? get_cur_bg_pal(attrib & 0b111) : get_cur_bg_pal(0);
-			uint8_t red, green, blue;
-			if (UseCGB) {
-				red = c(bg_ref[colorNum] & 0b11111);
-				green = c((bg_ref[colorNum] >> 5) & 0b11111);
-				blue = c((bg_ref[colorNum] >> 10) & 0b11111);
-			} else {
-				red = bus_.Palette[bg_ref[colorNum]][0];
-				green = bus_.Palette[bg_ref[colorNum]][1];
-				blue = bus_.Palette[bg_ref[colorNum]][2];
+			size_t pos = pixel + line.LY * 160;
+			const PaletteColors& bg_ref = settings.UseCGB ? line.BGPalettes[attrib & 0b111] : dmg_pal;
+			uint8_t index = settings.UseCGB ? (((attrib & 0b111) << 2) | colorNum) : bg_ref[colorNum];
+			uint16_t cgb_color = bg_ref[colorNum];
+			bg_line[pixel] = colorNum | (settings.UseCGB ? (attrib & 0b1000'0000) : 0);
+			if (change != line.PaletteChanges.end() && change->first == pixel) [[unlikely]] {
+				dmg_pal = change->second;
+				++change;
 			}
 			if (windowEnabled && identifierLoc == identifierLocationW) {
-				if (!DrawWindow) {
-					screen_color_data_second_[idx++] = bus_.Palette[0][0];
-					screen_color_data_second_[idx++] = bus_.Palette[0][1];
-					screen_color_data_second_[idx++] = bus_.Palette[0][2];
-					screen_color_data_second_[idx] = 255;	
+				if (!settings.DrawWindow) {
+					put_pixel(settings, buffer, pos, 0, 0x7FFF);
 					continue;
 				}
-			} else if (!DrawBackground) {
-				screen_color_data_second_[idx++] = bus_.Palette[0][0];
-				screen_color_data_second_[idx++] = bus_.Palette[0][1];
-				screen_color_data_second_[idx++] = bus_.Palette[0][2];
-				screen_color_data_second_[idx] = 255;
+			} else if (!settings.DrawBackground) {
+				put_pixel(settings, buffer, pos, 0, 0x7FFF);
 				continue;
 			}
-			if (bus_.ScanlineChanges.size() > 0) [[unlikely]] {
-				bool has_change = bus_.ScanlineChanges.contains(pixel);
-				if (has_change) [[unlikely]] {
-					// This sets it to the changed palette if it exists, or to itself if it doesn't
-					bg_ref = std::move(bus_.ScanlineChanges[pixel].new_bg_pal.value_or(bg_ref));
-				}
-			}
-			screen_color_data_second_[idx++] = red;
-			screen_color_data_second_[idx++] = green;
-			screen_color_data_second_[idx++] = blue;
-			screen_color_data_second_[idx] = 255;
+			put_pixel(settings, buffer, pos, index, cgb_color);
 		}
 	}
-	void PPU::render_sprites() {
-		bool use8x16 = LCDC & LCDCFlag::OBJ_SIZE;
-		// Sort depending on X and reverse iterate to correctly select sprite priority
-		if (!UseCGB) {
-			std::sort(cur_scanline_sprites_.begin(), cur_scanline_sprites_.end(), [this](const auto& lhs, const auto& rhs) {
-				return bus_.oam_[lhs + 1] < bus_.oam_[rhs + 1];
-			});
-		}
-		for (auto i = cur_scanline_sprites_.rbegin(); i != cur_scanline_sprites_.rend(); ++i) {
-			auto sprite = *i;
-			int16_t positionY = bus_.oam_[sprite] - 16;
-			int16_t positionX = bus_.oam_[sprite + 1] - 8;
-			uint8_t tileLoc = bus_.oam_[sprite + 2];
-			uint8_t attributes = bus_.oam_[sprite + 3];
+	inline void PPU::render_sprites(const LineState& line, const VramPages& vram, const RenderSettings& settings, uint8_t* buffer, const std::array<uint8_t, 160>& bg_line) const {
+		bool use8x16 = line.LCDC & LCDCFlag::OBJ_SIZE;
+		// Sprites are already in priority order, reverse iterate so the highest priority is drawn last
+		for (int i = line.SpriteCount - 1; i >= 0; --i) {
+			auto& sprite = line.Sprites[i];
+			int16_t positionY = sprite[0] - 16;
+			int16_t positionX = sprite[1] - 8;
+			uint8_t tileLoc = sprite[2];
+			uint8_t attributes = sprite[3];
 			if (use8x16) {
 				// dmg-acid2: Bit 0 of tile index for 8x16 objects should be ignored
 				tileLoc &= 0b1111'1110;
 			}
 			bool yFlip = attributes & 0b1000000;
 			bool xFlip = attributes & 0b100000;
-			// if its 8 aligned the sprite cant be between two tiles so we dont
-			// need to fetch the attributes every pixel
-			bool is_8_aligned = (positionX % 8) == 0;
 			int height = use8x16 ? 16 : 8;
-			int line = LY - positionY;
+			int row = line.LY - positionY;
 			if (yFlip) {
-				line -= height - 1;
-				line *= -1;
-			}
-			line *= 2;
-			uint16_t address = (0x8000 + (tileLoc * 16) + line);
-			bool vram_banks_bank = UseCGB ? (attributes & 0b1000) : false;
-			uint8_t data1 = bus_.vram_banks_[vram_banks_bank][address % 0x2000];
-			uint8_t data2 = bus_.vram_banks_[vram_banks_bank][(address + 1) % 0x2000];
+				row -= height - 1;
+				row *= -1;
+			}
+			row *= 2;
+			uint16_t address = (0x8000 + (tileLoc * 16) + row);
+			bool vram_banks_bank = settings.UseCGB ? (attributes & 0b1000) : false;
+			uint8_t data1 = read_vram(vram, vram_banks_bank, address);
+			uint8_t data2 = read_vram(vram, vram_banks_bank, address + 1);
+			bool obp1 = (attributes & 0b10000);
+			const PaletteColors& obj_ref = settings.UseCGB ? line.OBJPalettes[attributes & 0b111] : line.OBJPalettes[obp1];
 			for (int tilePixel = 7; tilePixel >= 0; tilePixel--) {
 				int colorbit = tilePixel;
 				if (xFlip) {
@@ -330,115 +839,60 @@ namespace TKPEmu::Gameboy::Devices {
 				}
 				int colorNum = ((data2 >> colorbit) & 0b1) << 1;
 				colorNum |= (data1 >> colorbit) & 0b1;
-				bool obp1 = (attributes & 0b10000);
-				auto& obj_ref = UseCGB ? get_cur_obj_pal(attributes & 0b111) : get_cur_obj_pal(obp1);	
 				int pixel = positionX - tilePixel + 7;
-				if ((LY > 143) || (pixel < 0) || (pixel > 159) || (colorNum == 0)) {
+				if ((line.LY > 143) || (pixel < 0) || (pixel > 159) || (colorNum == 0)) {
 					continue;
 				}
-				int idx = (pixel * 4) + (LY * 4 * 160);
-				bool windowEnabled = (LCDC & LCDCFlag::WND_ENABLE && WY <= LY) && positionX >= (WX - 7);
-				uint16_t identifierLoc;
-				if (windowEnabled) {
-					uint16_t identifierLocationW = (LCDC & LCDCFlag::WND_TILEMAP) ? 0x9C00 : 0x9800;
-					identifierLoc = identifierLocationW;
-				} else {
-					uint16_t identifierLocationB = (LCDC & LCDCFlag::BG_TILEMAP) ? 0x9C00 : 0x9800;
-					identifierLoc = identifierLocationB;
-				}
-				uint16_t bg_offset = ((SCX + pixel) / 8) + (((SCY + LY) / 8) * 32);
-				if (windowEnabled) {
-					bg_offset = ((pixel - (WX - 7)) / 8) + ((LY - WY - (window_internal_ * 4)) / 8) * 32;
+				size_t pos = pixel + line.LY * 160;
+				bool master_priority = line.LCDC & LCDCFlag::BG_ENABLE;
+				// Sprites with priority (or on cgb, over tiles with priority) only show over bg color 0
+				bool bg_priority = (attributes & 0b1000'0000) || (bg_line[pixel] & 0b1000'0000);
+				if (settings.UseCGB && !master_priority) {
+					bg_priority = false;
 				}
-				uint8_t bg_attributes = bus_.vram_banks_[1][(identifierLoc + bg_offset) % 0x2000];
-				bool master_priority = LCDC & LCDCFlag::BG_ENABLE;
-				uint8_t red, green, blue;
-				if (UseCGB) {
-					red = c(obj_ref[colorNum] & 0b11111);
-					green = c((obj_ref[colorNum] >> 5) & 0b11111);
-					blue = c((obj_ref[colorNum] >> 10) & 0b11111);
-				} else {
-					auto color = obj_ref[colorNum];
-					red = bus_.Palette[color][0];
-					green = bus_.Palette[color][1];
-					blue = bus_.Palette[color][2];
+				if (bg_priority && (bg_line[pixel] & 0b11)) {
+					continue;
 				}
-				if (UseCGB) {
-					if ((bg_attributes & 0b1000'0000) && master_priority) {
-						auto& bg_ref = get_cur_bg_pal(bg_attributes & 0b111);
-						auto bg_red = c(bg_ref[0] & 0b11111);
-						auto bg_green = c((bg_ref[0] >> 5) & 0b11111);
-						auto bg_blue = c((bg_ref[0] >> 10) & 0b11111);
-						if (!(screen_color_data_second_[idx] == bg_red &&
-							screen_color_data_second_[idx + 1] == bg_green && 
-							screen_color_data_second_[idx + 2] == bg_blue)) {
-							continue;
-						}
-					}
+				uint8_t index = settings.UseCGB ? (0b10'0000 | ((attributes & 0b111) << 2) | colorNum) : obj_ref[colorNum];
+				put_pixel(settings, buffer, pos, index, obj_ref[colorNum]);
+				if (settings.SpriteDebugColor && screen_format_ == ScreenFormat::RGBA8888) {
+					buffer[pos * 4] = 255;
 				}
-				if (attributes & 0b1000'0000) {
-					if (UseCGB) {
-						if (master_priority) {
-							auto& bg_ref = get_cur_bg_pal(bg_attributes & 0b111);
-							auto bg_red = c(bg_ref[0] & 0b11111);
-							auto bg_green = c((bg_ref[0] >> 5) & 0b11111);
-							auto bg_blue = c((bg_ref[0] >> 10) & 0b11111);
-							if (!(screen_color_data_second_[idx] == bg_red &&
-								screen_color_data_second_[idx + 1] == bg_green && 
-								screen_color_data_second_[idx + 2] == bg_blue)) {
-								continue;
-							}
-						}
+			}
+		}
+	}
+	void PPU::FillTileset(uint8_t* pixels, bool indexed) {
+		bool redraw_all = pixels != tileset_pixels_ || indexed != tileset_indexed_ || bus_.Palette != tileset_palette_;
+		tileset_pixels_ = pixels;
+		tileset_indexed_ = indexed;
+		tileset_palette_ = bus_.Palette;
+		size_t bpp = indexed ? 1 : 4;
+		for (size_t tile = 0; tile < tileset_versions_.size(); tile++) {
+			uint32_t version = bus_.TileVersions[tile];
+			if (!redraw_all && version == tileset_versions_[tile]) {
+				continue;
+			}
+			tileset_versions_[tile] = version;
+			size_t bank = tile / 384;
+			size_t x = bank * 128 + (tile % 16) * 8;
+			size_t y = ((tile % 384) / 16) * 8;
+			const uint8_t* data = &bus_.vram_banks_[bank][(tile % 384) * 16];
+			for (size_t row = 0; row < 8; row++) {
+				uint8_t low = data[row * 2];
+				uint8_t high = data[row * 2 + 1];
+				uint8_t* out = &pixels[((y + row) * 256 + x) * bpp];
+				for (size_t j = 0; j < 8; j++) {
+					int color = (((high >> (7 - j)) & 0b1) << 1) | ((low >> (7 - j)) & 0b1);
+					if (indexed) {
+						out[j] = color;
 					} else {
-						auto& bg_ref = get_cur_bg_pal(0);
-						if (!(screen_color_data_second_[idx] == bus_.Palette[bg_ref[0]][0] &&
-							screen_color_data_second_[idx + 1] == bus_.Palette[bg_ref[0]][1] && 
-							screen_color_data_second_[idx + 2] == bus_.Palette[bg_ref[0]][2])) {
-							continue;
-						}
-					}
-				}
-				red += (280 - red) * SpriteDebugColor;
-				screen_color_data_second_[idx++] = red;
-				screen_color_data_second_[idx++] = green;
-				screen_color_data_second_[idx++] = blue;
-				screen_color_data_second_[idx] = 255;
-			}
-		}
-	}
-	void PPU::FillTileset(float* pixels, size_t x_off, size_t y_off, uint16_t addr) {
-		for (int y_ = 0; y_ < 16; ++y_) {
-			for (int x_ = 0; x_ < 16; ++x_) {
-				for (size_t i = 0; i < 16; i += 2) {
-					uint16_t curr_addr = addr + i + x_ * 16 + y_ * 256;
-					uint8_t data1 = bus_.Read(curr_addr);
-					uint8_t data2 = bus_.Read(curr_addr + 1);
-					int x = ((i / 16) + x_) * 8;
-					int y = i / 2 + y_ * 8;
-					size_t start_idx = y * 256 * 4 + x * 4 + x_off * 4 + y_off * 256 * 4;
-					for (size_t j = 0; j < 8; j++) {
-						int color = (((data1 >> (7 - j)) & 0b1) << 1) + ((data2 >> (7 - j)) & 0b1);
-						pixels[start_idx + (j * 4) + 0] = bus_.Palette[color][0];
-						pixels[start_idx + (j * 4) + 1] = bus_.Palette[color][1];
-						pixels[start_idx + (j * 4) + 2] = bus_.Palette[color][2];
-						pixels[start_idx + (j * 4) + 3] = 255.0f;
+						out[j * 4 + 0] = bus_.Palette[color][0];
+						out[j * 4 + 1] = bus_.Palette[color][1];
+						out[j * 4 + 2] = bus_.Palette[color][2];
+						out[j * 4 + 3] = 255;
 					}
 				}
 			}
 		}
 	}
-	PaletteColors& PPU::get_cur_bg_pal(uint8_t attributes) {
-		if (UseCGB) {
-			return bus_.BGPalettes[attributes];
-		} else {
-			return bus_.BGPalettes[0];
-		}
-	}
-	PaletteColors& PPU::get_cur_obj_pal(uint8_t attributes) {
-		if (UseCGB) {
-			return bus_.OBJPalettes[attributes];
-		} else {
-			return bus_.OBJPalettes[!!(attributes)];
-		}
-	}
-}
+}
\ No newline at end of file
@@ -3,12 +3,83 @@
 #define TKP_GB_PPU_H
 #include <GameboyTKP/gb_bus.h>
 #include <GameboyTKP/gb_addresses.h>
+#include <GameboyTKP/gb_ppu_fifo.h>
 #include <mutex>
+#include <atomic>
 #include <array>
+#include <bitset>
 #include <queue>
+#include <deque>
+#include <thread>
+#include <memory>
+#include <condition_variable>
 
+namespace TKPEmu::Gameboy::QA {
+	class TestGameboy;
+}
+namespace TKPEmu::Gameboy::Utils {
+	class FrameCapture;
+	class Upscaler;
+	enum class UpscaleFilter;
+}
 namespace TKPEmu::Gameboy::Devices {
 	constexpr int FRAME_CYCLES = 70224;
+	// Pixel format of the screen buffer, chosen before emulation starts
+	// Indexed writes the DMG shade (0-3) or the CGB palette entry
+	// (bit 5 set for objects, bits 4-2 palette number, bits 1-0 color)
+	enum class ScreenFormat {
+		RGBA8888,
+		RGB565,
+		RGB555,
+		Indexed,
+	};
+	enum class PPUBackend {
+		// Draws whole scanlines when HBlank starts, mode 3 length is approximated
+		Scanline,
+		// Dot by dot pixel FIFO, slower but timing accurate
+		Fifo,
+	};
+#ifdef GAMEBOY_PPU_FIFO
+	constexpr PPUBackend DEFAULT_PPU_BACKEND = PPUBackend::Fifo;
+#else
+	constexpr PPUBackend DEFAULT_PPU_BACKEND = PPUBackend::Scanline;
+#endif
+	// VRAM as 64 pages of Bus::PAGE_SIZE bytes, bank 0 first
+	using VramPages = std::array<const uint8_t*, 64>;
+	inline uint8_t read_vram(const VramPages& vram, bool bank, uint16_t address) {
+		return vram[bank * 32 + ((address & 0x1FFF) >> 8)][address & 0xFF];
+	}
+	// Everything needed to render a scanline, captured when the scanline is drawn
+	struct LineState {
+		uint8_t LY = 0, LCDC = 0, SCX = 0, SCY = 0, WX = 0, WY = 0;
+		uint8_t WindowLine = 0;
+		bool WindowVisible = false;
+		uint8_t SpriteCount = 0;
+		std::array<std::array<uint8_t, 4>, 10> Sprites{};
+		std::array<PaletteColors, 8> BGPalettes{};
+		std::array<PaletteColors, 8> OBJPalettes{};
+		// Mid-scanline BGP writes as (pixel, new palette), ordered by pixel
+		std::vector<std::pair<uint8_t, PaletteColors>> PaletteChanges;
+		// Page table of the VRAM this line reads from when rendering is deferred
+		size_t VramIndex = 0;
+	};
+	// Host settings the renderer reads, copied on the emulation thread so
+	// the render workers never read the live ones
+	struct RenderSettings {
+		bool UseCGB = false;
+		bool DrawBackground = true;
+		bool DrawWindow = true;
+		bool DrawSprites = true;
+		bool SpriteDebugColor = false;
+		std::array<std::array<uint8_t, 3>, 4> Palette{};
+	};
+	// Line hashes of a published frame and the lines that changed since the
+	// frame published before it
+	struct FrameInfo {
+		std::array<uint64_t, 144> LineHashes{};
+		std::bitset<144> DirtyLines;
+		uint64_t Hash = 0;
+	};
 	class PPU {
 	public:
 		bool ReadyToDraw = false;
@@ -17,32 +88,189 @@ namespace TKPEmu::Gameboy::Devices {
 		bool DrawWindow = true;
 		bool DrawSprites = true;
 		bool UseCGB = false;
-		PPU(Bus& bus, std::mutex* draw_mutex);
+		// Render one out of every FrameSkip + 1 frames, timing is unaffected
+		int FrameSkip = 0;
+		// Only render the frames asked for with RequestFrame
+		bool RenderOnDemand = false;
+		// Scanlines are recorded and rendered on worker threads after VBlank
+		// Change with SetDeferredRendering
+		bool DeferredRendering = false;
+		PPU(Bus& bus);
+		~PPU();
 		void Update(uint8_t cycles);
+		// The CPU hands out the cycles of an instruction from its first memory access
+		// on, one M-cycle late for the PPU. Runs the FIFO that M-cycle ahead for a
+		// read, the next Update skips it
+		void CatchUp();
 		void Reset();
+		// Lists the state saved in save states, see gb_state.h. The screen
+		// buffers aren't part of it, a state loaded mid-frame finishes the
+		// frame on top of the lines already drawn
+		template<class Archive>
+		void Serialize(Archive& archive);
+		// Returns the latest finished frame, must only be called from one thread
 		uint8_t* GetScreenData();
-		void FillTileset(float* pixels, size_t x_off = 0, size_t y_off = 0, uint16_t addr = 0x8000);
+		// Sequence number of the frame last returned by GetScreenData
+		uint64_t GetFrameSequence() { return front_sequence_; }
+		// Info of the frame last returned by GetScreenData
+		const FrameInfo& GetFrameInfo() { return frame_info_[front_index_]; }
+		void RequestFrame() { frame_requested_ = true; }
+		// VBlanks entered since construction
+		uint64_t GetVBlankCount() { return vblanks_; }
+		// Overrides whether the next frame is rendered, call right after VBlank
+		void SetRenderFrame(bool render) { render_frame_ = render; }
+		// Publishes the newest frame of another PPU with the same screen
+		// format as if this one had rendered it. Nothing is published if
+		// the source has no new frame, like while its LCD is off
+		void PresentFrame(PPU& source);
+		void SetScreenFormat(ScreenFormat format);
+		ScreenFormat GetScreenFormat() { return screen_format_; }
+		size_t GetBytesPerPixel() { return bytes_per_pixel_; }
+		void SetDeferredRendering(bool deferred);
+		// Streams every published frame to a file, see gb_capture.h
+		// Returns false if the file can't be opened or the screen format is Indexed
+		bool StartCapture(const std::string& path);
+		void StopCapture();
+		// Upscales every published frame on a worker thread, see gb_upscaler.h
+		// Returns false if the filter doesn't support the screen format or scale
+		bool EnableUpscaler(Utils::UpscaleFilter filter, int scale = 2);
+		void DisableUpscaler();
+		// Valid until the upscaler is disabled or the screen format changes
+		Utils::Upscaler* GetUpscaler() { return upscaler_.get(); }
+		// Deferred rendering only applies to the scanline backend
+		void SetBackend(PPUBackend backend) { backend_ = backend; }
+		PPUBackend GetBackend() { return backend_; }
+		// Draws the 384 tiles of each VRAM bank, 16 tiles per row, to a 256x192 image
+		// with bank 0 on the left half. Pixels are RGBA8888, or color numbers when indexed.
+		// Only tiles written since the last call are redrawn, so the image has to be kept
+		void FillTileset(uint8_t* pixels, bool indexed = false);
 	private:
 		Bus& bus_;
-		std::mutex* draw_mutex_;
-		std::array<uint8_t, 4 * 160 * 144> screen_color_data_{};
-		std::array<uint8_t, 4 * 160 * 144> screen_color_data_second_{};
+		PixelFifo fifo_;
+		PPUBackend backend_ = DEFAULT_PPU_BACKEND;
+		ScreenFormat screen_format_ = ScreenFormat::RGBA8888;
+		size_t bytes_per_pixel_ = 4;
+		// Triple buffered screen. The PPU renders to the back buffer and publishes
+		// finished frames to the middle slot, GetScreenData takes them from there.
+		// middle_ packs the buffer index (bits 0-1), a fresh frame flag (bit 2)
+		// and the frame sequence number (bits 3-63)
+		std::array<std::vector<uint8_t>, 3> screen_buffers_;
+		uint8_t* back_buffer_ = nullptr;
+		size_t back_index_ = 0;
+		size_t front_index_ = 1;
+		std::atomic<uint64_t> middle_ = 2;
+		uint64_t frame_sequence_ = 0;
+		uint64_t front_sequence_ = 0;
+		// Line hashes are computed as lines are rendered into each buffer
+		std::array<FrameInfo, 3> frame_info_;
+		std::array<uint64_t, 144> published_hashes_{};
+		std::unique_ptr<Utils::FrameCapture> capture_;
+		std::mutex capture_mutex_;
+		std::unique_ptr<Utils::Upscaler> upscaler_;
+		std::mutex upscaler_mutex_;
+		// Scanlines recorded in one frame for deferred rendering. One job is
+		// recorded by the emulation thread while the other one is rendered
+		struct FrameJob {
+			std::array<LineState, 144> Lines;
+			std::array<bool, 144> Recorded{};
+			// A new page table is made when VRAM changes between two lines,
+			// only the pages written since the previous table are copied
+			std::vector<VramPages> PageTables;
+			size_t PageTablesUsed = 0;
+			std::deque<std::array<uint8_t, Bus::PAGE_SIZE>> PageCopies;
+			size_t PageCopiesUsed = 0;
+			// Bus::PageVersions of the pages the newest table points to
+			std::array<uint32_t, 64> PageVersions{};
+			RenderSettings Settings;
+			uint8_t* Buffer = nullptr;
+			size_t BufferIndex = 0;
+		};
+		LineState inline_line_;
+		// Pages of the live VRAM, the inline renderer reads from them
+		VramPages inline_vram_{};
+		// Settings of the renderers that run on the emulation thread, updated every scanline
+		RenderSettings inline_settings_;
+		std::array<FrameJob, 2> frame_jobs_;
+		size_t recording_job_ = 0;
+		uint64_t recorded_vram_version_ = 0;
+		std::vector<std::thread> render_workers_;
+		std::mutex render_mutex_;
+		std::condition_variable render_cv_;
+		std::condition_variable render_done_cv_;
+		FrameJob* rendering_job_ = nullptr;
+		uint64_t render_generation_ = 0;
+		std::atomic_int next_line_ = 0;
+		std::atomic_int lines_left_ = 0;
+		int busy_workers_ = 0;
+		bool frame_in_flight_ = false;
+		// Set by the worker that renders the last line, the emulation thread publishes the frame
+		std::atomic_bool frame_rendered_ = false;
+		bool stop_workers_ = false;
 		// PPU memory mapped registers
 		uint8_t& LCDC, &STAT, &LYC, &LY, &IF, &SCY, &SCX, &WY, &WX;
-		std::vector<uint8_t> cur_scanline_sprites_;
+		// OAM offsets of the sprites on a scanline, in drawing order (lowest priority first)
+		struct ScanlineSprites {
+			std::array<uint8_t, 10> Offsets{};
+			uint8_t Count = 0;
+			// Eligible sprites at x = 0, they lengthen mode 3
+			uint8_t ZeroXCount = 0;
+			uint64_t Generation = 0;
+			// OBJ_SIZE the line was scanned with, games change it mid-frame
+			bool ObjSize = false;
+		};
+		ScanlineSprites cur_scanline_sprites_;
+		// Per-line scan results, reused while OAM and the line's OBJ_SIZE stay the same
+		std::array<ScanlineSprites, 144> sprite_cache_{};
+		uint64_t sprite_cache_generation_ = 1;
+		uint64_t sprite_cache_oam_version_ = 0;
 		uint8_t window_internal_temp_ = 0;
 		uint8_t window_internal_ = 0;
 		int clock_ = 0;
-		int clock_target_ = 0;
+		// Cycles already run by CatchUp
+		int ahead_ = 0;
+		// The OAM scan interrupt of the next line was requested one M-cycle early
+		bool oam_irq_sent_ = false;
+		// Clock of the next mode or scanline transition, Update does no work before it
+		int next_event_ = 0;
+		uint8_t ly_ = 0;
+		bool drawing_ = false;
+		int scanline_x_offset_ = 0;
+		int mode3_extend_ = 0;
+		bool render_frame_ = true;
+		uint64_t vblanks_ = 0;
+		int frames_skipped_ = 0;
+		std::atomic_bool frame_requested_ = false;
+		// Tile versions and settings the tileset image was last drawn with
+		std::array<uint32_t, 768> tileset_versions_{};
+		uint8_t* tileset_pixels_ = nullptr;
+		bool tileset_indexed_ = false;
+		std::array<std::array<uint8_t, 3>, 4> tileset_palette_{};
+		void update_state();
+		void schedule_next_event();
 		int set_mode(int mode);
 		int get_mode();
 		int update_lyc();
 		bool is_sprite_eligible(uint8_t sprite_y);
+		void scan_oam();
+		bool update_window_line();
+		bool should_render_next();
+		void publish_frame();
+		void hash_line(size_t buffer_index, int ly);
+		void clear_screen();
 		void draw_scanline();
-		PaletteColors& get_cur_bg_pal(uint8_t attributes);
-		PaletteColors& get_cur_obj_pal(uint8_t attributes);
-		inline void render_tiles();
-		inline void render_sprites();
+		void capture_line(LineState& line, bool window_visible);
+		void snapshot_vram(FrameJob& job);
+		void dispatch_frame();
+		void wait_for_render();
+		void publish_rendered();
+		RenderSettings current_settings();
+		void render_worker();
+		void render_line(const LineState& line, const VramPages& vram, const RenderSettings& settings, uint8_t* buffer) const;
+		void put_pixel(const RenderSettings& settings, uint8_t* buffer, size_t pos, uint8_t index, uint16_t cgb_color) const;
+		inline void render_tiles(const LineState& line, const VramPages& vram, const RenderSettings& settings, uint8_t* buffer, std::array<uint8_t, 160>& bg_line) const;
+		inline void render_sprites(const LineState& line, const VramPages& vram, const RenderSettings& settings, uint8_t* buffer, const std::array<uint8_t, 160>& bg_line) const;
+		friend class PixelFifo;
+		friend class TKPEmu::Gameboy::QA::TestGameboy;
 	};
 }
 #endif
@@ -0,0 +1,269 @@
+#include <GameboyTKP/gb_ppu_fifo.h>
+#include <GameboyTKP/gb_ppu.h>
+#include <GameboyTKP/gb_state.h>
+#include <algorithm>
+namespace TKPEmu::Gameboy::Devices {
+	PixelFifo::PixelFifo(PPU& ppu, Bus& bus) : ppu_(ppu), bus_(bus) {}
+	template<class Archive>
+	void PixelFifo::Serialize(Archive& archive) {
+		archive(bg_fifo_, bg_head_, bg_size_, obj_fifo_, obj_head_, obj_size_);
+		archive(fetch_step_, fetch_dots_, fetcher_x_, tile_number_, tile_attributes_, tile_low_, tile_high_, tile_row_address_);
+		archive(sprites_, sprite_count_, next_sprite_, penalty_tile_);
+		archive(clock_, start_clock_, stall_, discard_, x_, window_active_, window_used_, wy_triggered_, window_line_, done_);
+	}
+	TKP_GB_SERIALIZE_INSTANTIATE(PixelFifo)
+	void PixelFifo::StartFrame() {
+		window_line_ = 0;
+		wy_triggered_ = false;
+	}
+	void PixelFifo::StartLine(int clock) {
+		// The first tile fetch of every line is thrown away, it takes 6 dots
+		start_clock_ = clock;
+		clock_ = clock + 6;
+		bg_head_ = bg_size_ = 0;
+		obj_head_ = obj_size_ = 0;
+		fetch_step_ = FetchStep::TileNumber;
+		fetch_dots_ = 0;
+		fetcher_x_ = 0;
+		stall_ = 0;
+		x_ = 0;
+		discard_ = ppu_.SCX & 0b111;
+		window_active_ = false;
+		window_used_ = false;
+		penalty_tile_ = -1;
+		done_ = false;
+		if (ppu_.LY == ppu_.WY) {
+			wy_triggered_ = true;
+		}
+		// Sprites are fetched by X, sprites with equal X in OAM order
+		auto& sprites = ppu_.cur_scanline_sprites_;
+		sprite_count_ = sprites.Count;
+		next_sprite_ = 0;
+		for (int i = 0; i < sprite_count_; i++) {
+			uint8_t offset = sprites.Offsets[i];
+			int j = i;
+			while (j > 0 && bus_.oam_[sprites_[j - 1] + 1] > bus_.oam_[offset + 1]) {
+				sprites_[j] = sprites_[j - 1];
+				--j;
+			}
+			sprites_[j] = offset;
+		}
+	}
+	int PixelFifo::Run(int clock) {
+		while (!done_ && clock_ < clock) {
+			step();
+			++clock_;
+		}
+		return done_ ? clock_ - start_clock_ : -1;
+	}
+	void PixelFifo::step() {
+		step_fetcher();
+		if (stall_ > 0) {
+			// Sprite fetch in progress, the background fetcher keeps going
+			--stall_;
+			return;
+		}
+		shift_pixel();
+	}
+	void PixelFifo::step_fetcher() {
+		auto& vram = bus_.vram_banks_;
+		uint8_t lcdc = ppu_.LCDC;
+		switch (fetch_step_) {
+			case FetchStep::TileNumber: {
+				if (++fetch_dots_ < 2)
+					break;
+				uint16_t map;
+				uint8_t x, y;
+				if (window_active_) {
+					map = (lcdc & LCDCFlag::WND_TILEMAP) ? 0x1C00 : 0x1800;
+					x = fetcher_x_;
+					y = window_line_;
+				} else {
+					map = (lcdc & LCDCFlag::BG_TILEMAP) ? 0x1C00 : 0x1800;
+					x = (ppu_.SCX >> 3) + fetcher_x_;
+					y = ppu_.LY + ppu_.SCY;
+				}
+				uint16_t map_address = map + ((y >> 3) << 5) + (x & 0b11111);
+				tile_number_ = vram[0][map_address];
+				tile_attributes_ = ppu_.UseCGB ? vram[1][map_address] : 0;
+				uint8_t row = y & 0b111;
+				if (tile_attributes_ & 0b100'0000) {
+					row = 7 - row;
+				}
+				if (lcdc & LCDCFlag::BG_TILES) {
+					tile_row_address_ = tile_number_ * 16 + row * 2;
+				} else {
+					tile_row_address_ = 0x1000 + static_cast<int8_t>(tile_number_) * 16 + row * 2;
+				}
+				fetch_step_ = FetchStep::DataLow;
+				fetch_dots_ = 0;
+				break;
+			}
+			case FetchStep::DataLow: {
+				if (++fetch_dots_ < 2)
+					break;
+				tile_low_ = vram[(tile_attributes_ >> 3) & 1][tile_row_address_];
+				fetch_step_ = FetchStep::DataHigh;
+				fetch_dots_ = 0;
+				break;
+			}
+			case FetchStep::DataHigh: {
+				if (++fetch_dots_ < 2)
+					break;
+				tile_high_ = vram[(tile_attributes_ >> 3) & 1][tile_row_address_ + 1];
+				fetch_step_ = FetchStep::Push;
+				fetch_dots_ = 0;
+				break;
+			}
+			case FetchStep::Push: {
+				// Retried every dot until the background FIFO is empty
+				if (bg_size_ == 0) {
+					push_tile();
+					fetch_step_ = FetchStep::TileNumber;
+				}
+				break;
+			}
+		}
+	}
+	void PixelFifo::push_tile() {
+		bool x_flip = tile_attributes_ & 0b10'0000;
+		for (int i = 0; i < 8; i++) {
+			int bit = x_flip ? i : 7 - i;
+			uint8_t color = (((tile_high_ >> bit) & 1) << 1) | ((tile_low_ >> bit) & 1);
+			bg_fifo_[(bg_head_ + bg_size_++) & 0b111] = { color, tile_attributes_ };
+		}
+		++fetcher_x_;
+	}
+	void PixelFifo::fetch_sprite(uint8_t offset) {
+		auto& oam = bus_.oam_;
+		uint8_t sprite_y = oam[offset];
+		uint8_t sprite_x = oam[offset + 1];
+		uint8_t tile = oam[offset + 2];
+		uint8_t attributes = oam[offset + 3];
+		bool use8x16 = ppu_.LCDC & LCDCFlag::OBJ_SIZE;
+		int height = use8x16 ? 16 : 8;
+		if (use8x16) {
+			tile &= 0b1111'1110;
+		}
+		int row = ppu_.LY - (sprite_y - 16);
+		if (attributes & 0b100'0000) {
+			row = height - 1 - row;
+		}
+		uint16_t address = tile * 16 + row * 2;
+		bool bank = ppu_.UseCGB && (attributes & 0b1000);
+		uint8_t low = bus_.vram_banks_[bank][address % 0x2000];
+		uint8_t high = bus_.vram_banks_[bank][(address + 1) % 0x2000];
+		// Pixels left of the screen are never shifted out
+		int skip = sprite_x < 8 ? 8 - sprite_x : 0;
+		while (obj_size_ < 8) {
+			obj_fifo_[(obj_head_ + obj_size_++) & 0b111] = { 0, 0, 0xFF };
+		}
+		uint8_t oam_index = offset / 4;
+		for (int i = skip; i < 8; i++) {
+			int bit = (attributes & 0b10'0000) ? i : 7 - i;
+			uint8_t color = (((high >> bit) & 1) << 1) | ((low >> bit) & 1);
+			if (color == 0)
+				continue;
+			// Pixels of an earlier fetched sprite win on DMG, the lower OAM index wins on CGB
+			ObjPixel& pixel = obj_fifo_[(obj_head_ + i - skip) & 0b111];
+			if (pixel.Color == 0 || (ppu_.UseCGB && oam_index < pixel.OamIndex)) {
+				pixel = { color, attributes, oam_index };
+			}
+		}
+		// The fetch waits for the background fetcher to finish the tile it is on, the
+		// first sprite on a tile costs 6 to 11 dots and later ones 6
+		uint8_t position = sprite_x + (window_active_ ? static_cast<uint8_t>(255 - ppu_.WX) : ppu_.SCX);
+		int penalty = 6;
+		if (position / 8 != penalty_tile_) {
+			penalty += 5 - std::min(5, position % 8);
+			penalty_tile_ = position / 8;
+		}
+		stall_ += penalty;
+	}
+	void PixelFifo::shift_pixel() {
+		uint8_t lcdc = ppu_.LCDC;
+		uint8_t wx = ppu_.WX;
+		if (!window_active_ && (lcdc & LCDCFlag::WND_ENABLE) && wy_triggered_ && wx <= 166 &&
+				(wx >= 7 ? x_ + 7 == wx : x_ == 0)) {
+			// Window starts, the fetcher restarts from its first tile
+			window_active_ = true;
+			window_used_ = true;
+			bg_head_ = bg_size_ = 0;
+			fetch_step_ = FetchStep::TileNumber;
+			fetch_dots_ = 0;
+			fetcher_x_ = 0;
+			discard_ = wx < 7 ? 7 - wx : 0;
+			return;
+		}
+		if (bg_size_ == 0)
+			return;
+		if (discard_ > 0) {
+			bg_head_ = (bg_head_ + 1) & 0b111;
+			--bg_size_;
+			--discard_;
+			return;
+		}
+		if (lcdc & LCDCFlag::OBJ_ENABLE) {
+			while (next_sprite_ < sprite_count_ && bus_.oam_[sprites_[next_sprite_] + 1] <= x_ + 8) {
+				fetch_sprite(sprites_[next_sprite_++]);
+			}
+			if (stall_ > 0) {
+				--stall_;
+				return;
+			}
+		}
+		BgPixel bg = bg_fifo_[bg_head_];
+		bg_head_ = (bg_head_ + 1) & 0b111;
+		--bg_size_;
+		ObjPixel obj = { 0, 0, 0xFF };
+		if (obj_size_ > 0) {
+			obj = obj_fifo_[obj_head_];
+			obj_head_ = (obj_head_ + 1) & 0b111;
+			--obj_size_;
+		}
+		if (ppu_.render_frame_) {
+			bool cgb = ppu_.UseCGB;
+			bool bg_enable = lcdc & LCDCFlag::BG_ENABLE;
+			// On DMG, BG_ENABLE turns the background and window white
+			uint8_t bg_color = (cgb || bg_enable) ? bg.Color : 0;
+			bool draw_obj = obj.Color != 0 && (lcdc & LCDCFlag::OBJ_ENABLE) && ppu_.DrawSprites;
+			if (draw_obj && bg_color != 0) {
+				// Sprites with priority (or on cgb, over tiles with priority) only show over bg color 0
+				// On CGB, BG_ENABLE clear gives sprites priority over everything
+				if (cgb) {
+					draw_obj = !bg_enable || !((obj.Attributes | bg.Attributes) & 0b1000'0000);
+				} else {
+					draw_obj = !(obj.Attributes & 0b1000'0000);
+				}
+			}
+			uint8_t* buffer = ppu_.back_buffer_;
+			size_t pos = ppu_.LY * 160 + x_;
+			if (draw_obj) {
+				uint8_t palette = cgb ? (obj.Attributes & 0b111) : ((obj.Attributes >> 4) & 1);
+				const PaletteColors& obj_pal = bus_.OBJPalettes[palette];
+				uint8_t index = cgb ? (0b10'0000 | (palette << 2) | obj.Color) : obj_pal[obj.Color];
+				ppu_.put_pixel(ppu_.inline_settings_, buffer, pos, index, obj_pal[obj.Color]);
+				if (ppu_.SpriteDebugColor && ppu_.screen_format_ == ScreenFormat::RGBA8888) {
+					buffer[pos * 4] = 255;
+				}
+			} else if (window_active_ ? !ppu_.DrawWindow : !ppu_.DrawBackground) {
+				ppu_.put_pixel(ppu_.inline_settings_, buffer, pos, 0, 0x7FFF);
+			} else if (cgb) {
+				uint8_t palette = bg.Attributes & 0b111;
+				ppu_.put_pixel(ppu_.inline_settings_, buffer, pos, (palette << 2) | bg_color, bus_.BGPalettes[palette][bg_color]);
+			} else {
+				uint8_t shade = bg_enable ? bus_.BGPalettes[0][bg_color] : 0;
+				ppu_.put_pixel(ppu_.inline_settings_, buffer, pos, shade, shade);
+			}
+		}
+		if (++x_ == 160) {
+			done_ = true;
+			if (ppu_.render_frame_) {
+				ppu_.hash_line(ppu_.back_index_, ppu_.LY);
+			}
+			if (window_used_) {
+				++window_line_;
+			}
+		}
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+#ifndef TKP_GB_PPU_FIFO_H
+#define TKP_GB_PPU_FIFO_H
+#include <GameboyTKP/gb_bus.h>
+#include <array>
+
+namespace TKPEmu::Gameboy::Devices {
+	class PPU;
+	// Dot by dot pixel transfer (mode 3) using a background fetcher and the two
+	// pixel FIFOs. Registers, VRAM, OAM and palettes are read from the bus as the
+	// pixels are fetched, so mid-scanline writes land on the right pixel, and the
+	// mode 3 length follows from SCX, the window and the sprite fetches
+	class PixelFifo {
+	public:
+		PixelFifo(PPU& ppu, Bus& bus);
+		void StartFrame();
+		// Starts mode 3 of the current scanline at the given PPU clock
+		void StartLine(int clock);
+		// Runs mode 3 up to the given PPU clock
+		// Returns the mode 3 length in dots once the scanline is finished, otherwise -1
+		int Run(int clock);
+		// Lists the state saved in save states, see gb_state.h
+		template<class Archive>
+		void Serialize(Archive& archive);
+	private:
+		struct BgPixel {
+			uint8_t Color;
+			// CGB tile attributes, bit 7 is the bg-to-obj priority, bits 0-2 the palette
+			uint8_t Attributes;
+		};
+		struct ObjPixel {
+			uint8_t Color;
+			uint8_t Attributes;
+			uint8_t OamIndex;
+		};
+		enum class FetchStep {
+			TileNumber,
+			DataLow,
+			DataHigh,
+			Push,
+		};
+		PPU& ppu_;
+		Bus& bus_;
+		std::array<BgPixel, 8> bg_fifo_{};
+		size_t bg_head_ = 0;
+		size_t bg_size_ = 0;
+		std::array<ObjPixel, 8> obj_fifo_{};
+		size_t obj_head_ = 0;
+		size_t obj_size_ = 0;
+		FetchStep fetch_step_ = FetchStep::TileNumber;
+		int fetch_dots_ = 0;
+		uint8_t fetcher_x_ = 0;
+		uint8_t tile_number_ = 0;
+		uint8_t tile_attributes_ = 0;
+		uint8_t tile_low_ = 0;
+		uint8_t tile_high_ = 0;
+		uint16_t tile_row_address_ = 0;
+		// Sprites of this scanline in the order they are fetched (by X, then OAM order)
+		std::array<uint8_t, 10> sprites_{};
+		uint8_t sprite_count_ = 0;
+		uint8_t next_sprite_ = 0;
+		// BG tile the last sprite fetch waited on, later sprites on it only cost 6 dots
+		int penalty_tile_ = -1;
+		int clock_ = 0;
+		int start_clock_ = 0;
+		int stall_ = 0;
+		int discard_ = 0;
+		uint8_t x_ = 0;
+		bool window_active_ = false;
+		bool window_used_ = false;
+		bool wy_triggered_ = false;
+		uint8_t window_line_ = 0;
+		bool done_ = true;
+		void step();
+		void step_fetcher();
+		void push_tile();
+		void fetch_sprite(uint8_t offset);
+		void shift_pixel();
+	};
+}
+#endif
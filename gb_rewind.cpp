@@ -0,0 +1,311 @@
+#include <GameboyTKP/gb_rewind.h>
+#include <algorithm>
+#include <cstring>
+
+namespace TKPEmu::Gameboy::Utils {
+	namespace {
+		// A literal ends at this many equal bytes, a shorter run costs more as
+		// its own record than as part of the literal
+		constexpr size_t MIN_RUN = 4;
+		void put_varint(std::vector<uint8_t>& out, size_t value) {
+			while (value >= 0x80) {
+				out.push_back((value & 0x7F) | 0x80);
+				value >>= 7;
+			}
+			out.push_back(value);
+		}
+		size_t get_varint(const uint8_t*& in) {
+			size_t value = 0;
+			int shift = 0;
+			while (*in & 0x80) {
+				value |= static_cast<size_t>(*in++ & 0x7F) << shift;
+				shift += 7;
+			}
+			value |= static_cast<size_t>(*in++) << shift;
+			return value;
+		}
+		uint64_t load_word(const uint8_t* data) {
+			uint64_t word;
+			std::memcpy(&word, data, sizeof(word));
+			return word;
+		}
+	}
+	RewindBuffer::RewindBuffer(size_t budget, int keyframe_interval, size_t pages_offset, size_t page_size) :
+		pages_offset_(pages_offset),
+		page_size_(page_size),
+		keyframe_interval_(std::max(keyframe_interval, 1)),
+		ring_(budget)
+	{
+		for (auto& frame : pool_) {
+			free_.push_back(&frame);
+		}
+		worker_ = std::thread(&RewindBuffer::rewind_worker, this);
+	}
+	RewindBuffer::~RewindBuffer() {
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			stop_ = true;
+		}
+		work_cv_.notify_one();
+		worker_.join();
+	}
+	RewindBuffer::Frame& RewindBuffer::GetFrame() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_cv_.wait(lock, [this] { return !free_.empty(); });
+		filling_ = free_.back();
+		free_.pop_back();
+		return *filling_;
+	}
+	void RewindBuffer::Push() {
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			queue_.push_back(filling_);
+			filling_ = nullptr;
+		}
+		work_cv_.notify_one();
+	}
+	bool RewindBuffer::Restore(int frames, std::vector<uint8_t>& state) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		wait_idle(lock);
+		if (frames < 0 || static_cast<size_t>(frames) >= entries_.size()) {
+			return false;
+		}
+		size_t newest = entries_.size() - 1;
+		size_t target = newest - frames;
+		// Starts from the newest state or the closest full state, whichever
+		// needs the fewest deltas
+		size_t from = newest;
+		size_t cost = frames;
+		for (size_t i = target; i <= newest; i++) {
+			if (entries_[i].KeySize != 0) {
+				if (i - target < cost) {
+					from = i;
+					cost = i - target;
+				}
+				break;
+			}
+		}
+		for (size_t i = target + 1; i-- > 0;) {
+			if (entries_[i].KeySize != 0) {
+				if (target - i < cost) {
+					from = i;
+					cost = target - i;
+				}
+				break;
+			}
+		}
+		if (from == newest && entries_[from].KeySize == 0) {
+			state = latest_;
+		} else {
+			state.assign(latest_.size(), 0);
+			apply(entries_[from].Start, entries_[from].KeySize, state.data());
+		}
+		auto apply_delta = [this, &state](size_t i) {
+			const Entry& entry = entries_[i];
+			apply(entry.Start + entry.KeySize, entry.DeltaSize, state.data());
+		};
+		// The delta of a frame takes it back to the previous one and the other
+		// way around
+		for (size_t i = from; i > target; i--) {
+			apply_delta(i);
+		}
+		for (size_t i = from + 1; i <= target; i++) {
+			apply_delta(i);
+		}
+		while (entries_.size() > target + 1) {
+			const Entry& entry = entries_.back();
+			used_ -= entry.KeySize + entry.DeltaSize;
+			entries_.pop_back();
+		}
+		const Entry& entry = entries_.back();
+		write_ = entry.Start + entry.KeySize + entry.DeltaSize;
+		since_keyframe_ = keyframe_interval_;
+		for (size_t i = target + 1; i-- > 0;) {
+			if (entries_[i].KeySize != 0) {
+				since_keyframe_ = target - i + 1;
+				break;
+			}
+		}
+		latest_ = state;
+		// The emulator's memory may not match the versions of the newest frame
+		full_compare_ = true;
+		return true;
+	}
+	void RewindBuffer::Clear() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		wait_idle(lock);
+		entries_.clear();
+		latest_.clear();
+		write_ = 0;
+		used_ = 0;
+	}
+	int RewindBuffer::GetFrameCount() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		wait_idle(lock);
+		return entries_.size();
+	}
+	size_t RewindBuffer::GetUsedBytes() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		wait_idle(lock);
+		return used_;
+	}
+	void RewindBuffer::wait_idle(std::unique_lock<std::mutex>& lock) {
+		done_cv_.wait(lock, [this] { return queue_.empty() && !busy_; });
+	}
+	void RewindBuffer::rewind_worker() {
+		while (true) {
+			Frame* frame;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				work_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+				if (queue_.empty()) {
+					return;
+				}
+				frame = queue_.front();
+				queue_.pop_front();
+				busy_ = true;
+			}
+			// Nothing else touches the entries while the worker is busy
+			encode_frame(*frame);
+			{
+				std::lock_guard<std::mutex> lg(mutex_);
+				free_.push_back(frame);
+				busy_ = false;
+			}
+			done_cv_.notify_all();
+		}
+	}
+	void RewindBuffer::encode_frame(Frame& frame) {
+		const uint8_t* state = frame.State.data();
+		size_t size = frame.State.size();
+		// A state of another cartridge starts over
+		bool chained = !entries_.empty() && latest_.size() == size;
+		encoded_.clear();
+		size_t key_size = 0;
+		if (!chained || since_keyframe_ >= keyframe_interval_) {
+			zeros_ = 0;
+			encode_xor(state, nullptr, size);
+			key_size = encoded_.size();
+			since_keyframe_ = 0;
+		}
+		if (chained) {
+			zeros_ = 0;
+			const uint8_t* previous = latest_.data();
+			size_t pages = 0;
+			if (!full_compare_ && frame.PageVersions.size() == latest_versions_.size() && size >= pages_offset_) {
+				pages = std::min(frame.PageVersions.size(), (size - pages_offset_) / page_size_);
+			}
+			size_t pages_end = pages_offset_ + pages * page_size_;
+			encode_xor(state, previous, pages == 0 ? size : pages_offset_);
+			for (size_t i = 0; i < pages; i++) {
+				size_t offset = pages_offset_ + i * page_size_;
+				if (frame.PageVersions[i] == latest_versions_[i]) {
+					zeros_ += page_size_;
+				} else {
+					encode_xor(state + offset, previous + offset, page_size_);
+				}
+			}
+			if (pages != 0) {
+				encode_xor(state + pages_end, previous + pages_end, size - pages_end);
+			}
+		} else {
+			entries_.clear();
+			used_ = 0;
+		}
+		full_compare_ = false;
+		++since_keyframe_;
+		size_t start;
+		if (allocate(encoded_.size(), start)) {
+			std::memcpy(ring_.data() + start, encoded_.data(), encoded_.size());
+			entries_.push_back({ start, key_size, encoded_.size() - key_size });
+			used_ += encoded_.size();
+			write_ = start + encoded_.size();
+		} else {
+			// Larger than the whole budget
+			entries_.clear();
+			used_ = 0;
+		}
+		std::swap(latest_, frame.State);
+		std::swap(latest_versions_, frame.PageVersions);
+	}
+	void RewindBuffer::encode_xor(const uint8_t* a, const uint8_t* b, size_t size) {
+		auto byte = [a, b](size_t i) -> uint8_t {
+			return b ? a[i] ^ b[i] : a[i];
+		};
+		auto word = [a, b](size_t i) {
+			return b ? load_word(a + i) ^ load_word(b + i) : load_word(a + i);
+		};
+		// Records of a run of equal bytes, then a literal of the XORed bytes,
+		// both lengths as varints
+		size_t i = 0;
+		while (i < size) {
+			size_t start = i;
+			while (i + 8 <= size && word(i) == 0) {
+				i += 8;
+			}
+			while (i < size && byte(i) == 0) {
+				i++;
+			}
+			zeros_ += i - start;
+			if (i == size) {
+				break;
+			}
+			size_t end = i;
+			for (size_t j = i; j < size && j - end < MIN_RUN; j++) {
+				if (byte(j) != 0) {
+					end = j + 1;
+				}
+			}
+			put_varint(encoded_, zeros_);
+			put_varint(encoded_, end - i);
+			size_t pos = encoded_.size();
+			encoded_.resize(pos + end - i);
+			for (size_t j = i; j < end; j++) {
+				encoded_[pos++] = byte(j);
+			}
+			zeros_ = 0;
+			i = end;
+		}
+	}
+	void RewindBuffer::apply(size_t start, size_t size, uint8_t* state) {
+		const uint8_t* in = ring_.data() + start;
+		const uint8_t* end = in + size;
+		size_t pos = 0;
+		while (in < end) {
+			pos += get_varint(in);
+			size_t count = get_varint(in);
+			for (size_t i = 0; i < count; i++) {
+				state[pos + i] ^= in[i];
+			}
+			in += count;
+			pos += count;
+		}
+	}
+	bool RewindBuffer::allocate(size_t size, size_t& start) {
+		if (size > ring_.size()) {
+			return false;
+		}
+		// The entries go from the oldest one up to write_, wrapping around at
+		// the end of the ring, so the free space is from write_ to the oldest
+		while (!entries_.empty()) {
+			size_t oldest = entries_.front().Start;
+			if (write_ > oldest) {
+				if (write_ + size <= ring_.size()) {
+					start = write_;
+					return true;
+				}
+				if (size <= oldest) {
+					start = 0;
+					return true;
+				}
+			} else if (write_ + size <= oldest) {
+				start = write_;
+				return true;
+			}
+			used_ -= entries_.front().KeySize + entries_.front().DeltaSize;
+			entries_.pop_front();
+		}
+		start = 0;
+		return true;
+	}
+}
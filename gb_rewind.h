@@ -0,0 +1,88 @@
+#pragma once
+#ifndef TKP_GB_REWIND_H
+#define TKP_GB_REWIND_H
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace TKPEmu::Gameboy::Utils {
+	// Keeps the save states of the last frames in a fixed amount of memory.
+	// Every frame is stored as the XOR of its state with the previous one, run
+	// length encoded, and every few frames the whole state is stored as well.
+	// XOR works both ways, so a frame is rebuilt from the closest full state
+	// before or after it, or from the newest one. Frames are encoded on a
+	// worker thread, the emulator only saves the state
+	class RewindBuffer {
+	public:
+		// A state to encode, with the versions of the pages of its memory
+		struct Frame {
+			std::vector<uint8_t> State;
+			std::vector<uint32_t> PageVersions;
+		};
+		// The memory pages start at pages_offset in every state. A page whose
+		// version is the same as in the previous frame is skipped without
+		// being compared
+		RewindBuffer(size_t budget, int keyframe_interval, size_t pages_offset, size_t page_size);
+		~RewindBuffer();
+		RewindBuffer(const RewindBuffer&) = delete;
+		RewindBuffer& operator=(const RewindBuffer&) = delete;
+		// The frame to fill before calling Push, waits if the worker is behind
+		Frame& GetFrame();
+		void Push();
+		// Rebuilds the state of the frame that many frames before the newest
+		// one and drops the frames after it. Returns false if it's not kept
+		bool Restore(int frames, std::vector<uint8_t>& state);
+		void Clear();
+		// Frames Restore can go back to, including the newest one
+		int GetFrameCount();
+		// Of the encoded frames, at most the budget
+		size_t GetUsedBytes();
+	private:
+		struct Entry {
+			// Offset in the ring, the full state comes first if there is one
+			size_t Start;
+			size_t KeySize;
+			size_t DeltaSize;
+		};
+		static constexpr int POOL_SIZE = 3;
+		size_t pages_offset_;
+		size_t page_size_;
+		int keyframe_interval_;
+		int since_keyframe_ = 0;
+		// Encoded frames, each one is contiguous, oldest first
+		std::vector<uint8_t> ring_;
+		std::deque<Entry> entries_;
+		size_t write_ = 0;
+		size_t used_ = 0;
+		// Only touched by the worker, or while it's idle
+		std::vector<uint8_t> latest_;
+		std::vector<uint32_t> latest_versions_;
+		// Set after a restore, the next frame compares every page
+		bool full_compare_ = false;
+		std::vector<uint8_t> encoded_;
+		size_t zeros_ = 0;
+		std::array<Frame, POOL_SIZE> pool_;
+		std::vector<Frame*> free_;
+		std::deque<Frame*> queue_;
+		Frame* filling_ = nullptr;
+		bool busy_ = false;
+		bool stop_ = false;
+		std::mutex mutex_;
+		std::condition_variable work_cv_;
+		std::condition_variable done_cv_;
+		std::thread worker_;
+		void rewind_worker();
+		void encode_frame(Frame& frame);
+		void wait_idle(std::unique_lock<std::mutex>& lock);
+		// Appends the XOR of a and b to encoded_, or a alone if b is null
+		void encode_xor(const uint8_t* a, const uint8_t* b, size_t size);
+		// XORs encoded bytes into a state
+		void apply(size_t start, size_t size, uint8_t* state);
+		// Makes room for an entry by dropping the oldest ones, returns its start
+		bool allocate(size_t size, size_t& start);
+	};
+}
+#endif
@@ -0,0 +1,54 @@
+#include <GameboyTKP/gb_state.h>
+#include <algorithm>
+
+namespace TKPEmu::Gameboy::Utils {
+	StateWriter::StateWriter(std::vector<uint8_t>& buffer, uint32_t cartridge) : buffer_(buffer), cartridge_(cartridge) {}
+	void StateWriter::grow(size_t size) {
+		// Only the first few saves get here, later ones fit
+		buffer_.resize(std::max(size, buffer_.size() * 2));
+	}
+	void StateWriter::BeginSection(uint32_t tag) {
+		section_start_ = pos_;
+		SectionHeader header { tag, 0 };
+		Bytes(&header, sizeof(header));
+		++section_count_;
+	}
+	void StateWriter::EndSection() {
+		uint32_t size = pos_ - section_start_ - sizeof(SectionHeader);
+		std::memcpy(buffer_.data() + section_start_ + offsetof(SectionHeader, Size), &size, sizeof(size));
+	}
+	void StateWriter::Finish() {
+		if (buffer_.size() < sizeof(StateHeader)) {
+			grow(sizeof(StateHeader));
+		}
+		StateHeader header { STATE_MAGIC, STATE_VERSION, static_cast<uint32_t>(pos_), section_count_, cartridge_ };
+		std::memcpy(buffer_.data(), &header, sizeof(header));
+		buffer_.resize(pos_);
+	}
+	StateReader::StateReader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+	bool StateReader::Validate(const std::vector<SectionHeader>& sections, uint32_t cartridge) {
+		if (size_ < sizeof(StateHeader)) {
+			return false;
+		}
+		StateHeader header;
+		std::memcpy(&header, data_, sizeof(header));
+		if (header.Magic != STATE_MAGIC || header.Version != STATE_VERSION ||
+				header.Size != size_ || header.SectionCount != sections.size() || header.Cartridge != cartridge) {
+			return false;
+		}
+		size_t pos = sizeof(StateHeader);
+		for (const auto& expected : sections) {
+			if (size_ - pos < sizeof(SectionHeader)) {
+				return false;
+			}
+			SectionHeader section;
+			std::memcpy(&section, data_ + pos, sizeof(section));
+			pos += sizeof(SectionHeader);
+			if (section.Tag != expected.Tag || section.Size != expected.Size || size_ - pos < section.Size) {
+				return false;
+			}
+			pos += section.Size;
+		}
+		return pos == size_;
+	}
+}
@@ -0,0 +1,165 @@
+#pragma once
+#ifndef TKP_GB_STATE_H
+#define TKP_GB_STATE_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+namespace TKPEmu::Gameboy::Utils {
+	// A save state is one contiguous buffer: a StateHeader, then a section for
+	// each device made of a SectionHeader and the device's fields as raw bytes.
+	// Each device lists its fields once in a Serialize template that is run
+	// with a StateWriter, a StateReader or a StateSizer, so saving, loading
+	// and validating can't disagree on the layout
+	// Bump when any Serialize function or serialized struct changes
+	constexpr uint32_t STATE_VERSION = 3;
+	constexpr uint32_t STATE_MAGIC = 0x54534247; // GBST
+	struct StateHeader {
+		uint32_t Magic;
+		uint32_t Version;
+		// Of the whole state, header included
+		uint32_t Size;
+		uint32_t SectionCount;
+		// States only load into the cartridge they were saved from
+		uint32_t Cartridge;
+	};
+	struct SectionHeader {
+		uint32_t Tag;
+		// Of the data after this header
+		uint32_t Size;
+	};
+	// Where the data of the first section starts
+	constexpr size_t FIRST_SECTION_OFFSET = sizeof(StateHeader) + sizeof(SectionHeader);
+	constexpr uint32_t StateTag(const char (&name)[5]) {
+		return name[0] | (name[1] << 8) | (name[2] << 16) | (static_cast<uint32_t>(name[3]) << 24);
+	}
+	// Hashes 8 bytes at a time, the seed chains calls together
+	inline uint64_t HashBytes(const void* data, size_t size, uint64_t seed) {
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		uint64_t hash = seed ^ (size * 0x9E3779B97F4A7C15ull);
+		auto mix = [&hash](uint64_t word) {
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+			hash ^= hash >> 32;
+		};
+		size_t i = 0;
+		for (; i + 8 <= size; i += 8) {
+			uint64_t word;
+			std::memcpy(&word, bytes + i, sizeof(word));
+			mix(word);
+		}
+		if (i < size) {
+			uint64_t word = 0;
+			std::memcpy(&word, bytes + i, size - i);
+			mix(word);
+		}
+		return hash;
+	}
+	// Only values that can be copied byte for byte, and no pointers since they
+	// don't survive a reload. Structs with padding would save and hash its
+	// uninitialized bytes, their fields have to be listed instead
+	template<class T>
+	concept StateValue = std::is_trivially_copyable_v<T> && !std::is_pointer_v<T> && std::has_unique_object_representations_v<T>;
+	// Writes into a buffer that is kept between saves, so once it has grown to
+	// fit a state saving only copies
+	class StateWriter {
+	public:
+		static constexpr bool Loading = false;
+		StateWriter(std::vector<uint8_t>& buffer, uint32_t cartridge);
+		template<StateValue... T>
+		void operator()(T&... values) {
+			(Bytes(&values, sizeof(T)), ...);
+		}
+		void Bytes(const void* data, size_t size) {
+			if (pos_ + size > buffer_.size()) {
+				grow(pos_ + size);
+			}
+			std::memcpy(buffer_.data() + pos_, data, size);
+			pos_ += size;
+		}
+		void BeginSection(uint32_t tag);
+		void EndSection();
+		// Fills in the header and trims the buffer to the size of the state
+		void Finish();
+	private:
+		std::vector<uint8_t>& buffer_;
+		uint32_t cartridge_;
+		size_t pos_ = sizeof(StateHeader);
+		size_t section_start_ = 0;
+		uint32_t section_count_ = 0;
+		void grow(size_t size);
+	};
+	// Only records the sections a state of the current emulator would have
+	class StateSizer {
+	public:
+		static constexpr bool Loading = false;
+		template<StateValue... T>
+		void operator()(T&... values) {
+			(Bytes(&values, sizeof(T)), ...);
+		}
+		void Bytes(const void*, size_t size) {
+			sections_.back().Size += size;
+		}
+		void BeginSection(uint32_t tag) {
+			sections_.push_back({ tag, 0 });
+		}
+		void EndSection() {}
+		const std::vector<SectionHeader>& GetSections() { return sections_; }
+	private:
+		std::vector<SectionHeader> sections_;
+	};
+	// Hashes the fields instead of storing them
+	class StateHasher {
+	public:
+		static constexpr bool Loading = false;
+		explicit StateHasher(uint64_t seed) : hash_(seed) {}
+		template<StateValue... T>
+		void operator()(T&... values) {
+			(Bytes(&values, sizeof(T)), ...);
+		}
+		void Bytes(const void* data, size_t size) {
+			hash_ = HashBytes(data, size, hash_);
+		}
+		void BeginSection(uint32_t tag) {
+			hash_ = HashBytes(&tag, sizeof(tag), hash_);
+		}
+		void EndSection() {}
+		uint64_t GetHash() { return hash_; }
+	private:
+		uint64_t hash_;
+	};
+	// Reads without bounds checks, Validate has to pass first
+	class StateReader {
+	public:
+		static constexpr bool Loading = true;
+		StateReader(const uint8_t* data, size_t size);
+		// Checks the header and that the sections match the ones the sizer
+		// recorded, in order and size
+		bool Validate(const std::vector<SectionHeader>& sections, uint32_t cartridge);
+		template<StateValue... T>
+		void operator()(T&... values) {
+			(Bytes(&values, sizeof(T)), ...);
+		}
+		void Bytes(void* data, size_t size) {
+			std::memcpy(data, data_ + pos_, size);
+			pos_ += size;
+		}
+		void BeginSection(uint32_t) {
+			pos_ += sizeof(SectionHeader);
+		}
+		void EndSection() {}
+	private:
+		const uint8_t* data_;
+		size_t size_;
+		size_t pos_ = sizeof(StateHeader);
+	};
+}
+// Serialize is a member template defined in the device's source file, this
+// instantiates it there for every archive
+#define TKP_GB_SERIALIZE_INSTANTIATE_FUNCTION(function) \
+	template void function(TKPEmu::Gameboy::Utils::StateWriter&); \
+	template void function(TKPEmu::Gameboy::Utils::StateSizer&); \
+	template void function(TKPEmu::Gameboy::Utils::StateHasher&); \
+	template void function(TKPEmu::Gameboy::Utils::StateReader&);
+#define TKP_GB_SERIALIZE_INSTANTIATE(type) TKP_GB_SERIALIZE_INSTANTIATE_FUNCTION(type::Serialize)
+#endif
@@ -1,6 +1,6 @@
 #include <GameboyTKP/gb_timer.h>
-#include <iostream>
-#include <bitset>
+#include <GameboyTKP/gb_state.h>
+#include <algorithm>
 namespace TKPEmu::Gameboy::Devices {
     Timer::Timer(ChannelArrayPtr channel_array_ptr, Bus& bus) : 
 		channel_array_ptr_(channel_array_ptr),
@@ -20,9 +20,26 @@ namespace TKPEmu::Gameboy::Devices {
         timer_counter_ = 0;
 		tima_overflow_ = false;
 		just_overflown_ = false;
+		pending_ = 0;
+		budget_ = 0;
     }
-    bool Timer::Update(uint8_t cycles, uint8_t old_if) {
-		bool ret = false;
+	template<class Archive>
+	void Timer::Serialize(Archive& archive) {
+		// DIV, TIMA, TMA and TAC are saved with the bus
+		archive(oscillator_, timer_counter_, pending_, budget_, tima_overflow_, just_overflown_);
+	}
+	TKP_GB_SERIALIZE_INSTANTIATE(Timer)
+	void Timer::Sync() {
+		// Nothing that happens at the start of an update can be pending here,
+		// those make every update take the slow path
+		if (pending_ != 0) {
+			advance(pending_);
+			pending_ = 0;
+		}
+		// The registers are about to change, recompute the next event
+		budget_ = 0;
+	}
+    bool Timer::update(uint8_t old_if) {
 		if (just_overflown_) {
 			// Passes tima_write_reloading
 			// If TIMA is written while cycle [B] (check cycle accurate docs) TMA is written instead
@@ -31,7 +48,6 @@ namespace TKPEmu::Gameboy::Devices {
 			}
 		}
 		just_overflown_ = false;
-		bool enabled = TAC & 0b100;
         if (tima_overflow_) {
 			// TIMA might've changed in this strange cycle (see the comment below)
 			// If it changes in that cycle, it doesn't update to be equal to TMA
@@ -65,28 +81,37 @@ namespace TKPEmu::Gameboy::Devices {
 			oscillator_ = 0;
 			timer_counter_ = 0;
 		}
-		RegisterType old_div = oscillator_ >> 8;
-		oscillator_ += cycles;
-		// Divider always equals the top 8 bits of the oscillator
-		DIV = oscillator_ >> 8;
-		if (old_div & 0b0001'0000) {
-			if (!(DIV & 0b0001'0000)) {
-				// Falling edge of bit 4, step frame sequencer
-				// TODO: cgb double speed makes it bit 5
-				for (int i = 0; i < 4; i++) {
-					auto& chan = (*channel_array_ptr_)[i];
-					chan.StepFrameSequencer();
-					if (chan.LengthTimer == 0) {
-						bus_.ClearNR52Bit(i);
-					}
-					if (chan.DisableChannelFlag) {
-						bus_.ClearNR52Bit(i);
-						chan.DisableChannelFlag = false;
-					}
+		int cycles = pending_;
+		pending_ = 0;
+		int old_oscillator = oscillator_;
+		bool ret = advance(cycles);
+		// Falling edge of bit 4 of DIV, which happens every 8192 cycles.
+		// Updates never span more than one of them
+		// TODO: cgb double speed makes it bit 5
+		if ((old_oscillator >> 13) != (oscillator_ >> 13)) {
+			bus_.SyncAPU();
+			for (int i = 0; i < 4; i++) {
+				auto& chan = (*channel_array_ptr_)[i];
+				chan.StepFrameSequencer();
+				if (chan.LengthTimer == 0) {
+					bus_.ClearNR52Bit(i);
+				}
+				if (chan.DisableChannelFlag) {
+					bus_.ClearNR52Bit(i);
+					chan.DisableChannelFlag = false;
 				}
 			}
 		}
-		if (enabled) {
+		schedule();
+		return ret;
+	}
+	bool Timer::advance(int cycles) {
+		bool ret = false;
+		oscillator_ += cycles;
+		// Divider always equals the top 8 bits of the oscillator
+		DIV = oscillator_ >> 8;
+		if (TAC & 0b100) {
+			int freq = interr_times_[TAC & 0b11];
 			timer_counter_ += cycles;
 			while (timer_counter_ >= freq) {
 				timer_counter_ -= freq;
@@ -103,4 +128,16 @@ namespace TKPEmu::Gameboy::Devices {
 		}
 		return ret;
 	}
+	void Timer::schedule() {
+		if (tima_overflow_ || just_overflown_) {
+			// Handled at the start of the next update
+			budget_ = 0;
+			return;
+		}
+		budget_ = 8192 - (oscillator_ & 8191);
+		if (TAC & 0b100) {
+			int freq = interr_times_[TAC & 0b11];
+			budget_ = std::min(budget_, (0x100 - TIMA) * freq - timer_counter_);
+		}
+	}
 }
\ No newline at end of file
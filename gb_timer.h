@@ -10,14 +10,34 @@ namespace TKPEmu::Gameboy::Devices {
     public:
         Timer(ChannelArrayPtr channel_array_ptr, Bus& bus);
         void Reset();
-        bool Update(uint8_t cycles, uint8_t old_if);
+        // Only counts the cycles until the next event (TIMA overflow, frame
+        // sequencer step or a register write), DIV and TIMA are brought up to
+        // date then or when they are read
+        inline bool Update(uint8_t cycles, uint8_t old_if) {
+            pending_ += cycles;
+            if (pending_ < budget_) {
+                return false;
+            }
+            return update(old_if);
+        }
+        // Applies the counted cycles to DIV and TIMA, called by the bus before
+        // a timer register is read or written
+        void Sync();
+        // Lists the state saved in save states, see gb_state.h
+        template<class Archive>
+        void Serialize(Archive& archive);
     private:
         ChannelArrayPtr channel_array_ptr_;
         Bus& bus_;
         RegisterType &DIV, &TIMA, &TAC, &TMA, &IF;
         int oscillator_, timer_counter_;
+        // Cycles not yet applied and how many can pass before the next event
+        int pending_ = 0, budget_ = 0;
         bool tima_overflow_, just_overflown_;
         const std::array<const unsigned, 4> interr_times_ { 1024, 16, 64, 256 };
+        bool update(uint8_t old_if);
+        bool advance(int cycles);
+        void schedule();
     };
 }
-#endif
\ No newline at end of file
+#endif
@@ -3,6 +3,7 @@
 #include <chrono>
 #include <syncstream>
 #include <filesystem>
+#include <utility>
 // #include <valgrind/callgrind.h>
 #include <GameboyTKP/gb_tkpwrapper.h>
 #include <lib/md5.h>
@@ -19,14 +20,17 @@ namespace TKPEmu::Gameboy {
 	Gameboy_TKPWrapper::Gameboy_TKPWrapper() : 
 		channel_array_ptr_(std::make_shared<ChannelArray>()),
 		bus_(channel_array_ptr_),
-		apu_(channel_array_ptr_, bus_.GetReference(addr_NR52)),
-		ppu_(bus_, &DrawMutex),
+		apu_(channel_array_ptr_, bus_.GetReference(addr_NR52), &bus_.GetReference(addr_wav)),
+		ppu_(bus_),
 		timer_(channel_array_ptr_, bus_),
 		cpu_(bus_, ppu_, apu_, timer_),
 		joypad_(bus_.GetReference(addr_joy)),
 		interrupt_flag_(bus_.GetReference(addr_if))
 	{
 		(*channel_array_ptr_.get())[0].HasSweep = true;
+		bus_.apu_ = &apu_;
+		bus_.timer_ = &timer_;
+		bus_.ppu_ = &ppu_;
 		const EmulatorUserData& user_data = EmulatorFactory::GetEmulatorUserData()[static_cast<int>(EmuType::Gameboy)];
 		const KeyMappings& mappings = EmulatorFactory::GetEmulatorData()[static_cast<int>(EmuType::Gameboy)].Mappings;
 		if (!mappings.KeyValues.empty()) {
@@ -106,57 +110,361 @@ namespace TKPEmu::Gameboy {
 			auto request = MessageQueue->PopRequest();
 			poll_request(request);
 		}
-		update_audio_sync();
-		v_log();
-	}
-	void Gameboy_TKPWrapper::update_audio_sync() {
-		if ((apu_.IsQueueEmpty()) || FastMode) {
-			CALLGRIND_START_INSTRUMENTATION;
-			uint8_t old_if = interrupt_flag_;
-			int clk = 0;
-			if (!cpu_.skip_next_)
-				clk = cpu_.Update();
-			cpu_.skip_next_ = false;
-			if (timer_.Update(clk, old_if)) {
-				if (cpu_.halt_) {
-					cpu_.halt_ = false;
-					cpu_.skip_next_ = true;
-				}
+		apu_.SetFastMode(FastMode);
+		if (FastMode || Paused.load()) {
+			step();
+			was_paused_ = true;
+		} else {
+			if (was_paused_) {
+				// Don't make up for the time spent paused
+				pacer_.Reset();
+				was_paused_ = false;
+			}
+			if (run_ahead_ != 0) {
+				run_ahead_frame();
+			} else {
+				run_frame();
 			}
-			ppu_.Update(clk);
-			apu_.Update(clk);
-			CALLGRIND_STOP_INSTRUMENTATION;
+			pacer_.WaitForFrame();
+		}
+	}
+	void Gameboy_TKPWrapper::run_frame() {
+		while (frame_clk_ < FRAME_CLOCKS) {
+			frame_clk_ += step();
+		}
+		frame_clk_ -= FRAME_CLOCKS;
+	}
+	void Gameboy_TKPWrapper::run_to_vblank() {
+		uint64_t vblanks = ppu_.GetVBlankCount();
+		// VBlanks come every frame, a scanline more leaves room for the
+		// instruction that crosses into it
+		int clk = 0;
+		while (ppu_.GetVBlankCount() == vblanks && clk < FRAME_CLOCKS + 456) {
+			clk += step();
+		}
+	}
+	void Gameboy_TKPWrapper::run_ahead_frame() {
+		// The real frame is heard but not shown
+		ppu_.SetRenderFrame(false);
+		run_to_vblank();
+		SaveState(run_ahead_state_);
+		Gameboy_TKPWrapper& ahead = run_ahead_instance_ ? *run_ahead_instance_ : *this;
+		// Frames that get undone aren't recorded for rewinding or in a movie
+		auto rewind = std::move(rewind_);
+		auto movie_mode = std::exchange(movie_mode_, MovieMode::None);
+		if (run_ahead_instance_) {
+			ahead.bus_.DirectionKeys = bus_.DirectionKeys;
+			ahead.bus_.ActionKeys = bus_.ActionKeys;
+			ahead.bus_.Palette = bus_.Palette;
+			ahead.LoadState(run_ahead_state_);
+		} else {
+			apu_.SetMuted(true);
+		}
+		for (int i = 1; i <= run_ahead_; i++) {
+			ahead.ppu_.SetRenderFrame(i == run_ahead_);
+			ahead.run_to_vblank();
+		}
+		if (run_ahead_instance_) {
+			ppu_.PresentFrame(ahead.ppu_);
 		} else {
-			// std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			LoadState(run_ahead_state_);
+			apu_.SetMuted(false);
 		}
+		rewind_ = std::move(rewind);
+		movie_mode_ = movie_mode;
 	}
-	void Gameboy_TKPWrapper::HandleKeyDown(uint32_t key) {
-		if (auto it_dir = std::find(direction_keys_.begin(), direction_keys_.end(), key); it_dir != direction_keys_.end()) {
-			int index = it_dir - direction_keys_.begin();
-			bus_.DirectionKeys &= (~(1UL << index));
-			interrupt_flag_ |= IFInterrupt::JOYPAD;
+	int Gameboy_TKPWrapper::step() {
+		CALLGRIND_START_INSTRUMENTATION;
+		uint8_t old_if = interrupt_flag_;
+		int clk = 0;
+		if (!cpu_.skip_next_)
+			clk = cpu_.Update();
+		cpu_.skip_next_ = false;
+		if (timer_.Update(clk, old_if)) {
+			if (cpu_.halt_) {
+				cpu_.halt_ = false;
+				cpu_.skip_next_ = true;
+			}
 		}
-		if (auto it_dir = std::find(action_keys_.begin(), action_keys_.end(), key); it_dir != action_keys_.end()) {
-			int index = it_dir - action_keys_.begin();
-			bus_.ActionKeys &= (~(1UL << index));
-			interrupt_flag_ |= IFInterrupt::JOYPAD;
+		ppu_.Update(clk);
+		apu_.Update(clk);
+		if (movie_mode_ != MovieMode::None) [[unlikely]] {
+			movie_clk_ += clk;
+			if (movie_clk_ >= FRAME_CLOCKS) {
+				movie_clk_ -= FRAME_CLOCKS;
+				start_movie_frame();
+			}
+		}
+		if (rewind_) [[unlikely]] {
+			rewind_clk_ += clk;
+			if (rewind_clk_ >= FRAME_CLOCKS) {
+				rewind_clk_ -= FRAME_CLOCKS;
+				record_rewind();
+			}
+		}
+		CALLGRIND_STOP_INSTRUMENTATION;
+		v_log();
+		return clk;
+	}
+	void Gameboy_TKPWrapper::HandleKeyDown(uint32_t key) {
+		uint8_t mask = get_key_mask(key);
+		uint8_t keys = host_keys_.fetch_and(~mask) & ~mask;
+		if (mask != 0 && !latch_keys_) {
+			set_keys(keys);
 		}
 	}
 	void Gameboy_TKPWrapper::HandleKeyUp(uint32_t key) {
-		if (auto it_dir = std::find(direction_keys_.begin(), direction_keys_.end(), key); it_dir != direction_keys_.end()) {
-			int index = it_dir - direction_keys_.begin();
-			bus_.DirectionKeys |= (1UL << index);
+		uint8_t mask = get_key_mask(key);
+		uint8_t keys = host_keys_.fetch_or(mask) | mask;
+		if (mask != 0 && !latch_keys_) {
+			set_keys(keys);
+		}
+	}
+	uint8_t Gameboy_TKPWrapper::get_key_mask(uint32_t key) {
+		uint8_t mask = 0;
+		if (auto it = std::find(direction_keys_.begin(), direction_keys_.end(), key); it != direction_keys_.end()) {
+			mask |= 1 << (it - direction_keys_.begin());
 		}
-		if (auto it_dir = std::find(action_keys_.begin(), action_keys_.end(), key); it_dir != action_keys_.end()) {
-			int index = it_dir - action_keys_.begin();
-			bus_.ActionKeys |= (1UL << index);
+		if (auto it = std::find(action_keys_.begin(), action_keys_.end(), key); it != action_keys_.end()) {
+			mask |= 0x10 << (it - action_keys_.begin());
 		}
+		return mask;
+	}
+	void Gameboy_TKPWrapper::set_keys(uint8_t keys) {
+		uint8_t held = (bus_.DirectionKeys & 0xF) | (bus_.ActionKeys << 4);
+		// Only a key going down raises the interrupt
+		if (held & ~keys) {
+			interrupt_flag_ |= IFInterrupt::JOYPAD;
+		}
+		bus_.DirectionKeys = (bus_.DirectionKeys & 0xF0) | (keys & 0xF);
+		bus_.ActionKeys = (bus_.ActionKeys & 0xF0) | (keys >> 4);
 	}
 	bool Gameboy_TKPWrapper::load_file(std::string path) {
 		auto loaded = bus_.LoadCartridge(std::forward<std::string>(path));
 		ppu_.UseCGB = bus_.UseCGB;
 		return loaded;
 	}
+	bool Gameboy_TKPWrapper::StartAudioCapture(const std::string& path, int sample_rate, bool per_channel) {
+		using WavAudioSink = TKPEmu::Gameboy::Devices::WavAudioSink;
+		auto sink = std::make_unique<WavAudioSink>(path, sample_rate, 2);
+		if (!sink->IsOpen()) {
+			return false;
+		}
+		apu_.SetSink(std::move(sink));
+		std::filesystem::path mix_path = path;
+		for (int i = 0; i < 4; i++) {
+			std::unique_ptr<WavAudioSink> channel_sink;
+			if (per_channel) {
+				auto channel_path = mix_path.parent_path() / (mix_path.stem().string() + "_ch" + std::to_string(i + 1) + mix_path.extension().string());
+				channel_sink = std::make_unique<WavAudioSink>(channel_path.string(), sample_rate, 1);
+			}
+			apu_.SetChannelSink(i, std::move(channel_sink));
+		}
+		return true;
+	}
+	void Gameboy_TKPWrapper::sync_devices() {
+		bus_.SyncTimer();
+		bus_.SyncAPU();
+	}
+	void Gameboy_TKPWrapper::SaveState(std::vector<uint8_t>& state) {
+		sync_devices();
+		Utils::StateWriter writer(state, get_cartridge_id());
+		serialize(writer);
+		writer.Finish();
+	}
+	bool Gameboy_TKPWrapper::LoadState(const std::vector<uint8_t>& state) {
+		if (bus_.rom_banks_.empty()) {
+			return false;
+		}
+		// The layout a state of this emulator and cartridge has
+		Utils::StateSizer sizer;
+		serialize(sizer);
+		Utils::StateReader reader(state.data(), state.size());
+		if (!reader.Validate(sizer.GetSections(), get_cartridge_id())) {
+			return false;
+		}
+		serialize(reader);
+		return true;
+	}
+	uint64_t Gameboy_TKPWrapper::StateHash() {
+		sync_devices();
+		const auto& versions = bus_.PageVersions;
+		if (hashed_versions_.size() != versions.size()) {
+			// Another cartridge, every page is hashed again
+			page_hashes_.assign(versions.size(), 0);
+			hashed_versions_.resize(versions.size());
+			for (size_t i = 0; i < versions.size(); i++) {
+				hashed_versions_[i] = versions[i] - 1;
+			}
+			memory_hash_ = 0;
+		}
+		for (size_t i = 0; i < versions.size(); i++) {
+			if (versions[i] != hashed_versions_[i]) {
+				// Seeded with the index so equal pages don't cancel out
+				uint64_t hash = Utils::HashBytes(bus_.GetPage(i), Bus::PAGE_SIZE, i);
+				memory_hash_ ^= page_hashes_[i] ^ hash;
+				page_hashes_[i] = hash;
+				hashed_versions_[i] = versions[i];
+			}
+		}
+		Utils::StateHasher hasher(memory_hash_);
+		serialize_devices(hasher);
+		return hasher.GetHash();
+	}
+	void Gameboy_TKPWrapper::EnableRewind(size_t budget, int keyframe_interval) {
+		rewind_ = std::make_unique<Utils::RewindBuffer>(budget, keyframe_interval, Utils::FIRST_SECTION_OFFSET, Bus::PAGE_SIZE);
+		rewind_clk_ = 0;
+	}
+	void Gameboy_TKPWrapper::DisableRewind() {
+		rewind_.reset();
+	}
+	bool Gameboy_TKPWrapper::Rewind(int frames) {
+		if (!rewind_ || !rewind_->Restore(frames, rewind_state_)) {
+			return false;
+		}
+		rewind_clk_ = 0;
+		return LoadState(rewind_state_);
+	}
+	int Gameboy_TKPWrapper::GetRewindFrames() {
+		return rewind_ ? rewind_->GetFrameCount() : 0;
+	}
+	void Gameboy_TKPWrapper::SetRunAhead(int frames, bool second_instance) {
+		run_ahead_ = std::max(frames, 0);
+		run_ahead_instance_.reset();
+		if (run_ahead_ != 0 && second_instance) {
+			run_ahead_instance_ = std::make_unique<Gameboy_TKPWrapper>();
+			auto& ahead = *run_ahead_instance_;
+			ahead.bus_.CopyCartridge(bus_);
+			ahead.ppu_.UseCGB = ppu_.UseCGB;
+			ahead.ppu_.SetScreenFormat(ppu_.GetScreenFormat());
+			ahead.ppu_.SetBackend(ppu_.GetBackend());
+			ahead.ppu_.DrawBackground = ppu_.DrawBackground;
+			ahead.ppu_.DrawWindow = ppu_.DrawWindow;
+			ahead.ppu_.DrawSprites = ppu_.DrawSprites;
+			ahead.ppu_.SpriteDebugColor = ppu_.SpriteDebugColor;
+		}
+	}
+	void Gameboy_TKPWrapper::StartMovieRecording() {
+		stop_movie();
+		movie_.RomHash = get_rom_hash();
+		SaveState(movie_.StartState);
+		movie_.Keys.clear();
+		movie_mode_ = MovieMode::Recording;
+		latch_keys_ = true;
+		movie_clk_ = 0;
+		start_movie_frame();
+	}
+	Utils::Movie Gameboy_TKPWrapper::StopMovieRecording() {
+		Utils::Movie movie;
+		if (movie_mode_ == MovieMode::Recording) {
+			movie = std::move(movie_);
+		}
+		stop_movie();
+		return movie;
+	}
+	bool Gameboy_TKPWrapper::StartMoviePlayback(const Utils::Movie& movie) {
+		stop_movie();
+		if (bus_.rom_banks_.empty() || movie.RomHash != get_rom_hash() || !LoadState(movie.StartState)) {
+			return false;
+		}
+		movie_ = movie;
+		movie_frame_ = 0;
+		movie_mode_ = MovieMode::Playing;
+		latch_keys_ = true;
+		movie_clk_ = 0;
+		start_movie_frame();
+		return true;
+	}
+	bool Gameboy_TKPWrapper::RunMovie(const Utils::Movie& movie) {
+		if (!StartMoviePlayback(movie)) {
+			return false;
+		}
+		bool on_demand = ppu_.RenderOnDemand;
+		ppu_.RenderOnDemand = true;
+		apu_.SetFastMode(true);
+		while (movie_mode_ == MovieMode::Playing) {
+			step();
+		}
+		apu_.SetFastMode(FastMode);
+		ppu_.RenderOnDemand = on_demand;
+		return true;
+	}
+	void Gameboy_TKPWrapper::start_movie_frame() {
+		if (movie_mode_ == MovieMode::Recording) {
+			uint8_t keys = host_keys_;
+			movie_.Keys.push_back(keys);
+			set_keys(keys);
+		} else if (movie_frame_ < movie_.Keys.size()) {
+			set_keys(movie_.Keys[movie_frame_++]);
+		} else {
+			stop_movie();
+		}
+	}
+	void Gameboy_TKPWrapper::stop_movie() {
+		if (movie_mode_ == MovieMode::None) {
+			return;
+		}
+		movie_mode_ = MovieMode::None;
+		movie_ = {};
+		latch_keys_ = false;
+		// Back to the keys the host holds now
+		set_keys(host_keys_);
+	}
+	void Gameboy_TKPWrapper::record_rewind() {
+		// Only the save happens here, the worker compresses it
+		auto& frame = rewind_->GetFrame();
+		SaveState(frame.State);
+		frame.PageVersions = bus_.PageVersions;
+		rewind_->Push();
+	}
+	template<class Archive>
+	void Gameboy_TKPWrapper::serialize(Archive& archive) {
+		using Utils::StateTag;
+		// First, so its pages start at FIRST_SECTION_OFFSET
+		archive.BeginSection(StateTag("MEM "));
+		bus_.SerializeMemory(archive);
+		archive.EndSection();
+		serialize_devices(archive);
+	}
+	template<class Archive>
+	void Gameboy_TKPWrapper::serialize_devices(Archive& archive) {
+		using Utils::StateTag;
+		archive.BeginSection(StateTag("CPU "));
+		cpu_.Serialize(archive);
+		archive.EndSection();
+		archive.BeginSection(StateTag("BUS "));
+		bus_.Serialize(archive);
+		archive.EndSection();
+		archive.BeginSection(StateTag("PPU "));
+		ppu_.Serialize(archive);
+		archive.EndSection();
+		archive.BeginSection(StateTag("TIMR"));
+		timer_.Serialize(archive);
+		archive.EndSection();
+		archive.BeginSection(StateTag("APU "));
+		apu_.Serialize(archive);
+		archive.EndSection();
+		archive.BeginSection(StateTag("GB  "));
+		archive(frame_clk_);
+		archive.EndSection();
+	}
+	uint32_t Gameboy_TKPWrapper::get_cartridge_id() {
+		// FNV-1a of the title, the cartridge type, the sizes and the checksums
+		uint32_t hash = 0x811C9DC5;
+		for (int i = 0x134; i < 0x150; i++) {
+			hash = (hash ^ bus_.rom_banks_[0][i]) * 0x01000193;
+		}
+		return hash;
+	}
+	uint64_t Gameboy_TKPWrapper::get_rom_hash() {
+		uint64_t hash = 0xCBF29CE484222325;
+		for (const auto& bank : bus_.rom_banks_) {
+			for (uint8_t byte : bank) {
+				hash = (hash ^ byte) * 0x100000001B3;
+			}
+		}
+		return hash;
+	}
 	void* Gameboy_TKPWrapper::GetScreenData() {
 		return ppu_.GetScreenData();
 	}
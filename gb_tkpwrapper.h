@@ -7,10 +7,15 @@
 #include <GameboyTKP/gb_addresses.h>
 #include <GameboyTKP/gb_cpu.h>
 #include <GameboyTKP/gb_ppu.h>
+#include <GameboyTKP/gb_upscaler.h>
+#include <GameboyTKP/gb_pacer.h>
 #include <GameboyTKP/gb_bus.h>
 #include <GameboyTKP/gb_timer.h>
 #include <GameboyTKP/gb_apu.h>
 #include <GameboyTKP/gb_apu_ch.h>
+#include <GameboyTKP/gb_state.h>
+#include <GameboyTKP/gb_rewind.h>
+#include <GameboyTKP/gb_movie.h>
 
 namespace TKPEmu {
 	namespace Applications {
@@ -18,6 +23,7 @@ namespace TKPEmu {
 	}
 	namespace Gameboy::QA {
 		struct TestGameboy;
+		class BenchmarkGameboy;
 	}
 }
 namespace TKPEmu::Gameboy {
@@ -34,10 +40,79 @@ namespace TKPEmu::Gameboy {
 		using Bus = TKPEmu::Gameboy::Devices::Bus;
 		using Timer = TKPEmu::Gameboy::Devices::Timer;
 		using Cartridge = TKPEmu::Gameboy::Devices::Cartridge;
+		using ScreenFormat = TKPEmu::Gameboy::Devices::ScreenFormat;
+		using FrameInfo = TKPEmu::Gameboy::Devices::FrameInfo;
+		using PPUBackend = TKPEmu::Gameboy::Devices::PPUBackend;
+		using AudioSink = TKPEmu::Gameboy::Devices::AudioSink;
 		using GameboyBreakpoint = TKPEmu::Gameboy::Utils::GameboyBreakpoint;
 	public:
-		// Used by automated tests
+		// Used by automated tests, runs one instruction in FastMode and a
+		// paced frame otherwise
 		void Update() { update(); }
+		// Must be called before the emulator thread starts
+		void SetScreenFormat(ScreenFormat format) { ppu_.SetScreenFormat(format); }
+		void SetFrameSkip(int frame_skip) { ppu_.FrameSkip = frame_skip; }
+		void SetRenderOnDemand(bool on_demand) { ppu_.RenderOnDemand = on_demand; }
+		void RequestFrame() { ppu_.RequestFrame(); }
+		void SetDeferredRendering(bool deferred) { ppu_.SetDeferredRendering(deferred); }
+		void SetPPUBackend(PPUBackend backend) { ppu_.SetBackend(backend); }
+		uint64_t GetFrameSequence() { return ppu_.GetFrameSequence(); }
+		const FrameInfo& GetFrameInfo() { return ppu_.GetFrameInfo(); }
+		bool StartCapture(const std::string& path) { return ppu_.StartCapture(path); }
+		void StopCapture() { ppu_.StopCapture(); }
+		bool EnableUpscaler(Utils::UpscaleFilter filter, int scale = 2) { return ppu_.EnableUpscaler(filter, scale); }
+		void DisableUpscaler() { ppu_.DisableUpscaler(); }
+		Utils::Upscaler* GetUpscaler() { return ppu_.GetUpscaler(); }
+		// Must be called before the emulator thread starts, otherwise an SDL sink is opened
+		void SetAudioSink(std::unique_ptr<AudioSink> sink) { apu_.SetSink(std::move(sink)); }
+		// Writes the stereo mix to a wav file instead of playing it. With per_channel
+		// every channel also goes to its own mono file, name_ch1.wav to name_ch4.wav
+		bool StartAudioCapture(const std::string& path, int sample_rate = 48000, bool per_channel = false);
+		// Binary save states, see gb_state.h. Call from the emulator thread or
+		// while it's paused. The buffer is reused, once it fits a state saving
+		// doesn't allocate
+		void SaveState(std::vector<uint8_t>& state);
+		// Returns false and changes nothing if the state is from another
+		// version or cartridge
+		bool LoadState(const std::vector<uint8_t>& state);
+		// Records the state at the end of every frame so emulation can go back,
+		// see gb_rewind.h. A full state is kept every keyframe_interval frames,
+		// the default budget holds about ten minutes of most games
+		void EnableRewind(size_t budget = 64 << 20, int keyframe_interval = 60);
+		void DisableRewind();
+		// Goes back to the end of the frame that many frames before the last
+		// recorded one, the frames after it are forgotten. Returns false if
+		// it's older than the recording
+		bool Rewind(int frames);
+		// How many frames Rewind can go back, plus one
+		int GetRewindFrames();
+		// Hides that many frames of input lag. After every real frame the
+		// state is saved, the next frames are run with the sound muted, the
+		// last one is shown and the state is loaded back. With
+		// second_instance they run on a copy of the emulator instead, so the
+		// real one is never reloaded. Only applies to real-time emulation
+		void SetRunAhead(int frames, bool second_instance = false);
+		int GetRunAhead() { return run_ahead_; }
+		// A hash of everything a save state holds, equal states hash the same.
+		// Memory pages are only hashed again after they're written, so it's
+		// cheap enough to call every frame
+		uint64_t StateHash();
+		// Records the keys held in every frame from the current state on, see
+		// gb_movie.h. While a movie is recorded or played, keys pressed on the
+		// host take effect when the next frame starts. Call from the emulator
+		// thread or while it's paused, loading a state or rewinding while
+		// recording makes the movie play back differently
+		void StartMovieRecording();
+		// Stops recording, the frame in progress is the last one
+		Utils::Movie StopMovieRecording();
+		// Loads the start state and holds the movie's keys instead of the
+		// host's until its last frame ends. Returns false if the movie is from
+		// another ROM or version
+		bool StartMoviePlayback(const Utils::Movie& movie);
+		bool IsPlayingMovie() { return movie_mode_ == MovieMode::Playing; }
+		// Plays the whole movie before returning, without rendering and
+		// without sound on real-time sinks
+		bool RunMovie(const Utils::Movie& movie);
 	private:
 		ChannelArrayPtr channel_array_ptr_;
 		Bus bus_;
@@ -48,12 +123,67 @@ namespace TKPEmu::Gameboy {
 		GameboyKeys direction_keys_;
 		GameboyKeys action_keys_;
 		uint8_t& joypad_, &interrupt_flag_;
+		Utils::FramePacer pacer_;
+		static constexpr int FRAME_CLOCKS = 70224;
+		// Clocks run past the end of the last frame
+		int frame_clk_ = 0;
+		std::unique_ptr<Utils::RewindBuffer> rewind_;
+		std::vector<uint8_t> rewind_state_;
+		// Counted separately from frame_clk_ so it also runs in FastMode
+		int rewind_clk_ = 0;
+		int run_ahead_ = 0;
+		std::unique_ptr<Gameboy_TKPWrapper> run_ahead_instance_;
+		std::vector<uint8_t> run_ahead_state_;
+		enum class MovieMode {
+			None,
+			Recording,
+			Playing,
+		};
+		MovieMode movie_mode_ = MovieMode::None;
+		Utils::Movie movie_;
+		size_t movie_frame_ = 0;
+		// Counted like rewind_clk_, a frame of the movie starts when it wraps
+		int movie_clk_ = 0;
+		// Keys held on the host, in the layout of Movie::Keys
+		std::atomic<uint8_t> host_keys_ = 0xFF;
+		// Set while a movie is recorded or played, host keys then wait for a
+		// frame to start
+		std::atomic_bool latch_keys_ = false;
+		// Of the memory pages, as of the versions they were hashed at
+		std::vector<uint64_t> page_hashes_;
+		std::vector<uint32_t> hashed_versions_;
+		// XOR of page_hashes_
+		uint64_t memory_hash_ = 0;
+		bool was_paused_ = false;
 		void update();
-		// this is the old update function that was replaced by update_audio_sync
-		// keeping it anyway
-		__always_inline void update_audio_sync();
+		template<class Archive>
+		void serialize(Archive& archive);
+		// Every section but the memory
+		template<class Archive>
+		void serialize_devices(Archive& archive);
+		// Brings the timer and the APU up to date, so the same emulated
+		// moment always saves the same bytes whatever was deferred
+		void sync_devices();
+		// Identifies the cartridge a state belongs to
+		uint32_t get_cartridge_id();
+		// Runs instructions for a frame worth of clocks
+		void run_frame();
+		// Runs until the next VBlank, or a frame worth of clocks while the
+		// LCD is off
+		void run_to_vblank();
+		void run_ahead_frame();
+		// Runs one instruction and returns its clocks
+		__always_inline int step();
+		void record_rewind();
+		void start_movie_frame();
+		void stop_movie();
+		// Holds the keys, in the layout of Movie::Keys
+		void set_keys(uint8_t keys);
+		uint8_t get_key_mask(uint32_t key);
+		uint64_t get_rom_hash();
 		__always_inline void v_log() override;
 		friend class TKPEmu::Gameboy::QA::TestGameboy;
+		friend class TKPEmu::Gameboy::QA::BenchmarkGameboy;
 	};
 }
 #endif
@@ -0,0 +1,513 @@
+#include <GameboyTKP/gb_upscaler.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define GAMEBOY_UPSCALER_SIMD
+#endif
+namespace TKPEmu::Gameboy::Utils {
+	constexpr int UPSCALE_WIDTH = 160;
+	constexpr int UPSCALE_HEIGHT = 144;
+	constexpr int PADDED_WIDTH = UPSCALE_WIDTH + 2;
+	constexpr int PADDED_HEIGHT = UPSCALE_HEIGHT + 2;
+	namespace {
+	#if defined(__AVX2__)
+		struct Simd {
+			using Vec = __m256i;
+			static constexpr size_t BYTES = 32;
+			static Vec load(const void* src) { return _mm256_loadu_si256(static_cast<const __m256i*>(src)); }
+			static void store(void* dst, Vec v) { _mm256_storeu_si256(static_cast<__m256i*>(dst), v); }
+			static Vec ones() { return _mm256_set1_epi32(-1); }
+			static Vec and_(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+			static Vec or_(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+			// ~a & b
+			static Vec andnot(Vec a, Vec b) { return _mm256_andnot_si256(a, b); }
+			template<typename T>
+			static Vec equal(Vec a, Vec b) {
+				if constexpr (sizeof(T) == 1) return _mm256_cmpeq_epi8(a, b);
+				else if constexpr (sizeof(T) == 2) return _mm256_cmpeq_epi16(a, b);
+				else return _mm256_cmpeq_epi32(a, b);
+			}
+			// Elements of a and b alternating, lo gets the first half
+			template<typename T>
+			static void interleave(Vec a, Vec b, Vec& lo, Vec& hi) {
+				Vec l, h;
+				if constexpr (sizeof(T) == 1) { l = _mm256_unpacklo_epi8(a, b); h = _mm256_unpackhi_epi8(a, b); }
+				else if constexpr (sizeof(T) == 2) { l = _mm256_unpacklo_epi16(a, b); h = _mm256_unpackhi_epi16(a, b); }
+				else { l = _mm256_unpacklo_epi32(a, b); h = _mm256_unpackhi_epi32(a, b); }
+				// Unpacks work within 128-bit lanes
+				lo = _mm256_permute2x128_si256(l, h, 0x20);
+				hi = _mm256_permute2x128_si256(l, h, 0x31);
+			}
+			static Vec add32(Vec a, Vec b) { return _mm256_add_epi32(a, b); }
+			static Vec times4(Vec a) { return _mm256_slli_epi32(a, 2); }
+			static Vec greater32(Vec a, Vec b) { return _mm256_cmpgt_epi32(a, b); }
+			static Vec distance32(Vec a, Vec b) { return _mm256_abs_epi32(_mm256_sub_epi32(a, b)); }
+			static Vec average8(Vec a, Vec b) { return _mm256_avg_epu8(a, b); }
+		};
+	#elif defined(__SSE2__)
+		struct Simd {
+			using Vec = __m128i;
+			static constexpr size_t BYTES = 16;
+			static Vec load(const void* src) { return _mm_loadu_si128(static_cast<const __m128i*>(src)); }
+			static void store(void* dst, Vec v) { _mm_storeu_si128(static_cast<__m128i*>(dst), v); }
+			static Vec ones() { return _mm_set1_epi32(-1); }
+			static Vec and_(Vec a, Vec b) { return _mm_and_si128(a, b); }
+			static Vec or_(Vec a, Vec b) { return _mm_or_si128(a, b); }
+			// ~a & b
+			static Vec andnot(Vec a, Vec b) { return _mm_andnot_si128(a, b); }
+			template<typename T>
+			static Vec equal(Vec a, Vec b) {
+				if constexpr (sizeof(T) == 1) return _mm_cmpeq_epi8(a, b);
+				else if constexpr (sizeof(T) == 2) return _mm_cmpeq_epi16(a, b);
+				else return _mm_cmpeq_epi32(a, b);
+			}
+			// Elements of a and b alternating, lo gets the first half
+			template<typename T>
+			static void interleave(Vec a, Vec b, Vec& lo, Vec& hi) {
+				if constexpr (sizeof(T) == 1) { lo = _mm_unpacklo_epi8(a, b); hi = _mm_unpackhi_epi8(a, b); }
+				else if constexpr (sizeof(T) == 2) { lo = _mm_unpacklo_epi16(a, b); hi = _mm_unpackhi_epi16(a, b); }
+				else { lo = _mm_unpacklo_epi32(a, b); hi = _mm_unpackhi_epi32(a, b); }
+			}
+			static Vec add32(Vec a, Vec b) { return _mm_add_epi32(a, b); }
+			static Vec times4(Vec a) { return _mm_slli_epi32(a, 2); }
+			static Vec greater32(Vec a, Vec b) { return _mm_cmpgt_epi32(a, b); }
+			static Vec distance32(Vec a, Vec b) {
+				// No abs_epi32 before SSSE3
+				Vec diff = _mm_sub_epi32(a, b);
+				Vec sign = _mm_srai_epi32(diff, 31);
+				return _mm_sub_epi32(_mm_xor_si128(diff, sign), sign);
+			}
+			static Vec average8(Vec a, Vec b) { return _mm_avg_epu8(a, b); }
+		};
+	#endif
+	#ifdef GAMEBOY_UPSCALER_SIMD
+		using Vec = Simd::Vec;
+		// mask ? a : b
+		inline Vec select(Vec mask, Vec a, Vec b) {
+			return Simd::or_(Simd::and_(mask, a), Simd::andnot(mask, b));
+		}
+	#endif
+		// Same rounding as the SIMD byte average
+		inline uint32_t average_rgba(uint32_t a, uint32_t b) {
+			return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+		}
+		template<typename T>
+		void nearest(const T* src, T* dst, int scale) {
+			size_t out_width = UPSCALE_WIDTH * scale;
+			for (int y = 0; y < UPSCALE_HEIGHT; y++) {
+				const T* row = src + (y + 1) * PADDED_WIDTH + 1;
+				T* out = dst + y * scale * out_width;
+				int x = 0;
+			#ifdef GAMEBOY_UPSCALER_SIMD
+				constexpr int N = Simd::BYTES / sizeof(T);
+				if (scale == 2) {
+					for (; x < UPSCALE_WIDTH; x += N) {
+						Vec lo, hi, v = Simd::load(row + x);
+						Simd::interleave<T>(v, v, lo, hi);
+						Simd::store(out + x * 2, lo);
+						Simd::store(out + x * 2 + N, hi);
+					}
+				} else if (scale == 4) {
+					for (; x < UPSCALE_WIDTH; x += N) {
+						Vec lo, hi, v = Simd::load(row + x);
+						Simd::interleave<T>(v, v, lo, hi);
+						Vec a, b;
+						Simd::interleave<T>(lo, lo, a, b);
+						Simd::store(out + x * 4, a);
+						Simd::store(out + x * 4 + N, b);
+						Simd::interleave<T>(hi, hi, a, b);
+						Simd::store(out + x * 4 + N * 2, a);
+						Simd::store(out + x * 4 + N * 3, b);
+					}
+				}
+			#endif
+				for (; x < UPSCALE_WIDTH; x++) {
+					std::fill_n(out + x * scale, scale, row[x]);
+				}
+				for (int i = 1; i < scale; i++) {
+					std::memcpy(out + i * out_width, out, out_width * sizeof(T));
+				}
+			}
+		}
+		// Neighbours of E are named
+		// A B C
+		// D E F
+		// G H I
+		template<typename T>
+		void scale2x(const T* src, T* dst) {
+			constexpr size_t out_width = UPSCALE_WIDTH * 2;
+			for (int y = 0; y < UPSCALE_HEIGHT; y++) {
+				const T* b_row = src + y * PADDED_WIDTH + 1;
+				const T* e_row = b_row + PADDED_WIDTH;
+				const T* h_row = e_row + PADDED_WIDTH;
+				T* out0 = dst + y * 2 * out_width;
+				T* out1 = out0 + out_width;
+			#ifdef GAMEBOY_UPSCALER_SIMD
+				constexpr int N = Simd::BYTES / sizeof(T);
+				for (int x = 0; x < UPSCALE_WIDTH; x += N) {
+					Vec B = Simd::load(b_row + x), H = Simd::load(h_row + x);
+					Vec D = Simd::load(e_row + x - 1), E = Simd::load(e_row + x), F = Simd::load(e_row + x + 1);
+					Vec guard = Simd::andnot(Simd::or_(Simd::equal<T>(B, H), Simd::equal<T>(D, F)), Simd::ones());
+					Vec e0 = select(Simd::and_(guard, Simd::equal<T>(D, B)), D, E);
+					Vec e1 = select(Simd::and_(guard, Simd::equal<T>(B, F)), F, E);
+					Vec e2 = select(Simd::and_(guard, Simd::equal<T>(D, H)), D, E);
+					Vec e3 = select(Simd::and_(guard, Simd::equal<T>(H, F)), F, E);
+					Vec lo, hi;
+					Simd::interleave<T>(e0, e1, lo, hi);
+					Simd::store(out0 + x * 2, lo);
+					Simd::store(out0 + x * 2 + N, hi);
+					Simd::interleave<T>(e2, e3, lo, hi);
+					Simd::store(out1 + x * 2, lo);
+					Simd::store(out1 + x * 2 + N, hi);
+				}
+			#else
+				for (int x = 0; x < UPSCALE_WIDTH; x++) {
+					T B = b_row[x], H = h_row[x], D = e_row[x - 1], E = e_row[x], F = e_row[x + 1];
+					bool guard = B != H && D != F;
+					out0[x * 2] = guard && D == B ? D : E;
+					out0[x * 2 + 1] = guard && B == F ? F : E;
+					out1[x * 2] = guard && D == H ? D : E;
+					out1[x * 2 + 1] = guard && H == F ? F : E;
+				}
+			#endif
+			}
+		}
+		// rows holds the 9 output pixels of every input pixel of a row as 9 planes
+		template<typename T>
+		void scale3x(const T* src, T* dst, T* rows) {
+			constexpr size_t out_width = UPSCALE_WIDTH * 3;
+			for (int y = 0; y < UPSCALE_HEIGHT; y++) {
+				const T* b_row = src + y * PADDED_WIDTH + 1;
+				const T* e_row = b_row + PADDED_WIDTH;
+				const T* h_row = e_row + PADDED_WIDTH;
+				T* out = dst + y * 3 * out_width;
+			#ifdef GAMEBOY_UPSCALER_SIMD
+				constexpr int N = Simd::BYTES / sizeof(T);
+				for (int x = 0; x < UPSCALE_WIDTH; x += N) {
+					Vec A = Simd::load(b_row + x - 1), B = Simd::load(b_row + x), C = Simd::load(b_row + x + 1);
+					Vec D = Simd::load(e_row + x - 1), E = Simd::load(e_row + x), F = Simd::load(e_row + x + 1);
+					Vec G = Simd::load(h_row + x - 1), H = Simd::load(h_row + x), I = Simd::load(h_row + x + 1);
+					Vec guard = Simd::andnot(Simd::or_(Simd::equal<T>(B, H), Simd::equal<T>(D, F)), Simd::ones());
+					Vec db = Simd::and_(guard, Simd::equal<T>(D, B));
+					Vec bf = Simd::and_(guard, Simd::equal<T>(B, F));
+					Vec dh = Simd::and_(guard, Simd::equal<T>(D, H));
+					Vec hf = Simd::and_(guard, Simd::equal<T>(H, F));
+					Vec ea = Simd::equal<T>(E, A), ec = Simd::equal<T>(E, C);
+					Vec eg = Simd::equal<T>(E, G), ei = Simd::equal<T>(E, I);
+					Vec e[9];
+					e[0] = select(db, D, E);
+					e[1] = select(Simd::or_(Simd::andnot(ec, db), Simd::andnot(ea, bf)), B, E);
+					e[2] = select(bf, F, E);
+					e[3] = select(Simd::or_(Simd::andnot(eg, db), Simd::andnot(ea, dh)), D, E);
+					e[4] = E;
+					e[5] = select(Simd::or_(Simd::andnot(ei, bf), Simd::andnot(ec, hf)), F, E);
+					e[6] = select(dh, D, E);
+					e[7] = select(Simd::or_(Simd::andnot(ei, dh), Simd::andnot(eg, hf)), H, E);
+					e[8] = select(hf, F, E);
+					for (int i = 0; i < 9; i++) {
+						Simd::store(rows + i * UPSCALE_WIDTH + x, e[i]);
+					}
+				}
+				for (int i = 0; i < 9; i++) {
+					const T* plane = rows + i * UPSCALE_WIDTH;
+					T* out_row = out + (i / 3) * out_width + i % 3;
+					for (int x = 0; x < UPSCALE_WIDTH; x++) {
+						out_row[x * 3] = plane[x];
+					}
+				}
+			#else
+				for (int x = 0; x < UPSCALE_WIDTH; x++) {
+					T A = b_row[x - 1], B = b_row[x], C = b_row[x + 1];
+					T D = e_row[x - 1], E = e_row[x], F = e_row[x + 1];
+					T G = h_row[x - 1], H = h_row[x], I = h_row[x + 1];
+					bool guard = B != H && D != F;
+					bool db = guard && D == B, bf = guard && B == F;
+					bool dh = guard && D == H, hf = guard && H == F;
+					T* o = out + x * 3;
+					o[0] = db ? D : E;
+					o[1] = (db && E != C) || (bf && E != A) ? B : E;
+					o[2] = bf ? F : E;
+					o[out_width] = (db && E != G) || (dh && E != A) ? D : E;
+					o[out_width + 1] = E;
+					o[out_width + 2] = (bf && E != I) || (hf && E != C) ? F : E;
+					o[out_width * 2] = dh ? D : E;
+					o[out_width * 2 + 1] = (dh && E != I) || (hf && E != G) ? H : E;
+					o[out_width * 2 + 2] = hf ? F : E;
+				}
+			#endif
+			}
+		}
+		// For each corner the edge runs along its two orthogonal neighbours when
+		// they are closer to each other (and the far diagonals closer to E) than
+		// E is to the corner's diagonal. The corner is then blended with the
+		// neighbour closest to E
+		void xbr(const uint32_t* src, const int32_t* luma, uint32_t* dst) {
+			constexpr size_t out_width = UPSCALE_WIDTH * 2;
+			for (int y = 0; y < UPSCALE_HEIGHT; y++) {
+				size_t b_pos = y * PADDED_WIDTH + 1;
+				size_t e_pos = b_pos + PADDED_WIDTH;
+				size_t h_pos = e_pos + PADDED_WIDTH;
+				uint32_t* out0 = dst + y * 2 * out_width;
+				uint32_t* out1 = out0 + out_width;
+			#ifdef GAMEBOY_UPSCALER_SIMD
+				constexpr int N = Simd::BYTES / sizeof(uint32_t);
+				for (int x = 0; x < UPSCALE_WIDTH; x += N) {
+					Vec lA = Simd::load(luma + b_pos + x - 1), lB = Simd::load(luma + b_pos + x), lC = Simd::load(luma + b_pos + x + 1);
+					Vec lD = Simd::load(luma + e_pos + x - 1), lE = Simd::load(luma + e_pos + x), lF = Simd::load(luma + e_pos + x + 1);
+					Vec lG = Simd::load(luma + h_pos + x - 1), lH = Simd::load(luma + h_pos + x), lI = Simd::load(luma + h_pos + x + 1);
+					Vec B = Simd::load(src + b_pos + x), H = Simd::load(src + h_pos + x);
+					Vec D = Simd::load(src + e_pos + x - 1), E = Simd::load(src + e_pos + x), F = Simd::load(src + e_pos + x + 1);
+					Vec d_bf = Simd::distance32(lB, lF), d_fh = Simd::distance32(lF, lH);
+					Vec d_hd = Simd::distance32(lH, lD), d_db = Simd::distance32(lD, lB);
+					Vec d_ea = Simd::distance32(lE, lA), d_ec = Simd::distance32(lE, lC);
+					Vec d_eg = Simd::distance32(lE, lG), d_ei = Simd::distance32(lE, lI);
+					Vec d_eb = Simd::distance32(lE, lB), d_ed = Simd::distance32(lE, lD);
+					Vec d_ef = Simd::distance32(lE, lF), d_eh = Simd::distance32(lE, lH);
+					Vec ec_eg = Simd::add32(d_ec, d_eg), ea_ei = Simd::add32(d_ea, d_ei);
+					auto corner = [&](Vec along, Vec across, Vec diagonal, Vec cross, Vec closest) {
+						Vec edge = Simd::greater32(Simd::add32(across, Simd::times4(diagonal)), Simd::add32(cross, Simd::times4(along)));
+						return select(edge, Simd::average8(E, closest), E);
+					};
+					Vec tl = corner(d_db, Simd::add32(d_hd, d_bf), d_ea, ec_eg, select(Simd::greater32(d_ed, d_eb), B, D));
+					Vec tr = corner(d_bf, Simd::add32(d_db, d_fh), d_ec, ea_ei, select(Simd::greater32(d_eb, d_ef), F, B));
+					Vec bl = corner(d_hd, Simd::add32(d_fh, d_db), d_eg, ea_ei, select(Simd::greater32(d_eh, d_ed), D, H));
+					Vec br = corner(d_fh, Simd::add32(d_bf, d_hd), d_ei, ec_eg, select(Simd::greater32(d_ef, d_eh), H, F));
+					Vec lo, hi;
+					Simd::interleave<uint32_t>(tl, tr, lo, hi);
+					Simd::store(out0 + x * 2, lo);
+					Simd::store(out0 + x * 2 + N, hi);
+					Simd::interleave<uint32_t>(bl, br, lo, hi);
+					Simd::store(out1 + x * 2, lo);
+					Simd::store(out1 + x * 2 + N, hi);
+				}
+			#else
+				for (int x = 0; x < UPSCALE_WIDTH; x++) {
+					int32_t lA = luma[b_pos + x - 1], lB = luma[b_pos + x], lC = luma[b_pos + x + 1];
+					int32_t lD = luma[e_pos + x - 1], lE = luma[e_pos + x], lF = luma[e_pos + x + 1];
+					int32_t lG = luma[h_pos + x - 1], lH = luma[h_pos + x], lI = luma[h_pos + x + 1];
+					uint32_t B = src[b_pos + x], H = src[h_pos + x];
+					uint32_t D = src[e_pos + x - 1], E = src[e_pos + x], F = src[e_pos + x + 1];
+					int32_t d_bf = std::abs(lB - lF), d_fh = std::abs(lF - lH);
+					int32_t d_hd = std::abs(lH - lD), d_db = std::abs(lD - lB);
+					int32_t d_ea = std::abs(lE - lA), d_ec = std::abs(lE - lC);
+					int32_t d_eg = std::abs(lE - lG), d_ei = std::abs(lE - lI);
+					int32_t d_eb = std::abs(lE - lB), d_ed = std::abs(lE - lD);
+					int32_t d_ef = std::abs(lE - lF), d_eh = std::abs(lE - lH);
+					int32_t ec_eg = d_ec + d_eg, ea_ei = d_ea + d_ei;
+					auto corner = [&](int32_t along, int32_t across, int32_t diagonal, int32_t cross, uint32_t closest) {
+						bool edge = across + diagonal * 4 > cross + along * 4;
+						return edge ? average_rgba(E, closest) : E;
+					};
+					out0[x * 2] = corner(d_db, d_hd + d_bf, d_ea, ec_eg, d_ed > d_eb ? B : D);
+					out0[x * 2 + 1] = corner(d_bf, d_db + d_fh, d_ec, ea_ei, d_eb > d_ef ? F : B);
+					out1[x * 2] = corner(d_hd, d_fh + d_db, d_eg, ea_ei, d_eh > d_ed ? D : H);
+					out1[x * 2 + 1] = corner(d_fh, d_bf + d_hd, d_ei, ec_eg, d_ef > d_eh ? H : F);
+				}
+			#endif
+			}
+		}
+	}
+	Upscaler::Upscaler(ScreenFormat format, UpscaleFilter filter, int scale) :
+		format_(format),
+		filter_(filter)
+	{
+		switch (filter) {
+			case UpscaleFilter::Nearest: {
+				scale_ = scale;
+				break;
+			}
+			case UpscaleFilter::Scale2x:
+			case UpscaleFilter::XBR: {
+				scale_ = 2;
+				break;
+			}
+			case UpscaleFilter::Scale3x: {
+				scale_ = 3;
+				break;
+			}
+		}
+		switch (format) {
+			case ScreenFormat::RGBA8888: {
+				bytes_per_pixel_ = 4;
+				break;
+			}
+			case ScreenFormat::RGB565:
+			case ScreenFormat::RGB555: {
+				bytes_per_pixel_ = 2;
+				break;
+			}
+			case ScreenFormat::Indexed: {
+				bytes_per_pixel_ = 1;
+				break;
+			}
+		}
+		size_t frame_size = UPSCALE_WIDTH * UPSCALE_HEIGHT * bytes_per_pixel_;
+		size_t output_size = frame_size * scale_ * scale_;
+		padded_.resize(PADDED_WIDTH * PADDED_HEIGHT * bytes_per_pixel_);
+		if (filter == UpscaleFilter::XBR) {
+			luma_.resize(PADDED_WIDTH * PADDED_HEIGHT);
+		}
+		if (filter == UpscaleFilter::Scale3x) {
+			rows_.resize(UPSCALE_WIDTH * 9 * bytes_per_pixel_);
+		}
+		pending_.resize(frame_size);
+		working_.resize(frame_size);
+		back_.resize(output_size);
+		middle_.resize(output_size);
+		front_.resize(output_size);
+		worker_ = std::thread(&Upscaler::upscale_worker, this);
+	}
+	Upscaler::~Upscaler() {
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			stop_ = true;
+		}
+		pending_cv_.notify_one();
+		worker_.join();
+	}
+	bool Upscaler::IsSupported(ScreenFormat format, UpscaleFilter filter, int scale) {
+		switch (filter) {
+			case UpscaleFilter::Nearest:
+				return scale >= 1 && scale <= 4;
+			case UpscaleFilter::XBR:
+				return format == ScreenFormat::RGBA8888;
+			default:
+				return true;
+		}
+	}
+	const char* Upscaler::GetKernelName() {
+	#if defined(__AVX2__)
+		return "AVX2";
+	#elif defined(__SSE2__)
+		return "SSE2";
+	#else
+		return "Scalar";
+	#endif
+	}
+	void Upscaler::Push(const uint8_t* frame) {
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			if (has_pending_) {
+				++skipped_frames_;
+			}
+			std::memcpy(pending_.data(), frame, pending_.size());
+			has_pending_ = true;
+		}
+		pending_cv_.notify_one();
+	}
+	const uint8_t* Upscaler::GetFrame() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		if (middle_fresh_) {
+			std::swap(front_, middle_);
+			middle_fresh_ = false;
+			front_valid_ = true;
+		}
+		return front_valid_ ? front_.data() : nullptr;
+	}
+	double Upscaler::GetLastFrameTime() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		return last_frame_time_;
+	}
+	double Upscaler::GetAverageFrameTime() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		return processed_frames_ ? total_frame_time_ / processed_frames_ : 0;
+	}
+	uint64_t Upscaler::GetProcessedFrames() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		return processed_frames_;
+	}
+	uint64_t Upscaler::GetSkippedFrames() {
+		std::lock_guard<std::mutex> lg(mutex_);
+		return skipped_frames_;
+	}
+	void Upscaler::upscale(const uint8_t* frame, uint8_t* output) {
+		switch (bytes_per_pixel_) {
+			case 1: {
+				process<uint8_t>(frame, output);
+				break;
+			}
+			case 2: {
+				process<uint16_t>(frame, output);
+				break;
+			}
+			case 4: {
+				process<uint32_t>(frame, output);
+				break;
+			}
+		}
+	}
+	void Upscaler::upscale_worker() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lk(mutex_);
+				pending_cv_.wait(lk, [this]() {
+					return stop_ || has_pending_;
+				});
+				if (stop_) {
+					break;
+				}
+				std::swap(pending_, working_);
+				has_pending_ = false;
+			}
+			auto start = std::chrono::steady_clock::now();
+			upscale(working_.data(), back_.data());
+			std::chrono::duration<double, std::micro> time = std::chrono::steady_clock::now() - start;
+			std::lock_guard<std::mutex> lg(mutex_);
+			std::swap(back_, middle_);
+			middle_fresh_ = true;
+			last_frame_time_ = time.count();
+			total_frame_time_ += time.count();
+			++processed_frames_;
+		}
+	}
+	template<typename T>
+	void Upscaler::pad_frame(const uint8_t* frame) {
+		T* padded = reinterpret_cast<T*>(padded_.data());
+		for (int y = 0; y < PADDED_HEIGHT; y++) {
+			int src_y = std::clamp(y - 1, 0, UPSCALE_HEIGHT - 1);
+			T* row = padded + y * PADDED_WIDTH;
+			std::memcpy(row + 1, frame + src_y * UPSCALE_WIDTH * sizeof(T), UPSCALE_WIDTH * sizeof(T));
+			row[0] = row[1];
+			row[PADDED_WIDTH - 1] = row[UPSCALE_WIDTH];
+		}
+		// XBR only runs on RGBA8888
+		if constexpr (sizeof(T) == 4) {
+			if (filter_ == UpscaleFilter::XBR) {
+				const uint8_t* pixels = padded_.data();
+				for (size_t i = 0; i < luma_.size(); i++) {
+					const uint8_t* px = &pixels[i * 4];
+					luma_[i] = (px[0] * 77 + px[1] * 150 + px[2] * 29) >> 8;
+				}
+			}
+		}
+	}
+	template<typename T>
+	void Upscaler::process(const uint8_t* frame, uint8_t* output) {
+		pad_frame<T>(frame);
+		const T* src = reinterpret_cast<const T*>(padded_.data());
+		T* dst = reinterpret_cast<T*>(output);
+		switch (filter_) {
+			case UpscaleFilter::Nearest: {
+				nearest<T>(src, dst, scale_);
+				break;
+			}
+			case UpscaleFilter::Scale2x: {
+				scale2x<T>(src, dst);
+				break;
+			}
+			case UpscaleFilter::Scale3x: {
+				scale3x<T>(src, dst, reinterpret_cast<T*>(rows_.data()));
+				break;
+			}
+			case UpscaleFilter::XBR: {
+				if constexpr (sizeof(T) == 4) {
+					xbr(src, luma_.data(), dst);
+				}
+				break;
+			}
+		}
+	}
+}
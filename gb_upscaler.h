@@ -0,0 +1,85 @@
+#pragma once
+#ifndef TKP_GB_UPSCALER_H
+#define TKP_GB_UPSCALER_H
+#include <GameboyTKP/gb_ppu.h>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+namespace TKPEmu::Gameboy::Utils {
+	enum class UpscaleFilter {
+		// Integer pixel replication, 1x to 4x
+		Nearest,
+		// AdvMAME2x/3x, only compares pixels so it works on every screen format
+		Scale2x,
+		Scale3x,
+		// 2x, edges are found with the xBR weights over the 3x3 neighbourhood on
+		// the luma of each pixel and the corners along them are blended
+		XBR,
+	};
+	// Upscales the published frames on a worker thread, for builds without a GPU.
+	// The output has the same pixel format as the screen. Frames that arrive while
+	// the worker is busy replace the one waiting, so emulation is never stalled
+	class Upscaler {
+	public:
+		using ScreenFormat = TKPEmu::Gameboy::Devices::ScreenFormat;
+		~Upscaler();
+		Upscaler(const Upscaler&) = delete;
+		Upscaler& operator=(const Upscaler&) = delete;
+		// XBR blends colors so it needs RGBA8888, Nearest takes scales 1 to 4
+		static bool IsSupported(ScreenFormat format, UpscaleFilter filter, int scale);
+		// Instruction set the kernels were compiled for
+		static const char* GetKernelName();
+		int GetScale() { return scale_; }
+		int GetWidth() { return 160 * scale_; }
+		int GetHeight() { return 144 * scale_; }
+		void Push(const uint8_t* frame);
+		// Latest upscaled frame, nullptr until the first one is done
+		// The pointer is valid until the next call
+		const uint8_t* GetFrame();
+		// Filtering time of the last frame and the average since start, in microseconds
+		double GetLastFrameTime();
+		double GetAverageFrameTime();
+		uint64_t GetProcessedFrames();
+		uint64_t GetSkippedFrames();
+	private:
+		// Only made by PPU::EnableUpscaler, which checks IsSupported first
+		Upscaler(ScreenFormat format, UpscaleFilter filter, int scale);
+		ScreenFormat format_;
+		UpscaleFilter filter_;
+		int scale_;
+		size_t bytes_per_pixel_;
+		// Input with a one pixel border of repeated edge pixels, so the kernels
+		// can read the neighbours of every pixel without bounds checks
+		std::vector<uint8_t> padded_;
+		std::vector<int32_t> luma_;
+		// Scale3x output rows before they are interleaved
+		std::vector<uint8_t> rows_;
+		std::vector<uint8_t> pending_;
+		std::vector<uint8_t> working_;
+		// Output buffers, the worker writes back_ and swaps it with middle_
+		std::vector<uint8_t> back_;
+		std::vector<uint8_t> middle_;
+		std::vector<uint8_t> front_;
+		bool has_pending_ = false;
+		bool middle_fresh_ = false;
+		bool front_valid_ = false;
+		bool stop_ = false;
+		uint64_t skipped_frames_ = 0;
+		uint64_t processed_frames_ = 0;
+		double last_frame_time_ = 0;
+		double total_frame_time_ = 0;
+		std::mutex mutex_;
+		std::condition_variable pending_cv_;
+		std::thread worker_;
+		void upscale_worker();
+		// Only called by the worker, it owns the scratch buffers
+		void upscale(const uint8_t* frame, uint8_t* output);
+		template<typename T>
+		void pad_frame(const uint8_t* frame);
+		template<typename T>
+		void process(const uint8_t* frame, uint8_t* output);
+		friend class TKPEmu::Gameboy::Devices::PPU;
+	};
+}
+#endif
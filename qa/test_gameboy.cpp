@@ -1,23 +1,79 @@
 #include "../gb_tkpwrapper.h"
+#include <algorithm>
 #include <filesystem>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <thread>
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include "../../lib/threadpool.hxx"
 
 using TestResult = std::pair<bool, std::string>; // passed, path
+using FrameHashes = std::vector<uint64_t>;
 
 namespace TKPEmu::Gameboy::QA {
+    // Loaded and reset to run from the end of the boot rom as fast as possible
+    static std::unique_ptr<Gameboy_TKPWrapper> createGameboy(std::string path, std::unique_ptr<Devices::AudioSink> sink = nullptr) {
+        auto gb = std::make_unique<Gameboy_TKPWrapper>();
+        CPPUNIT_ASSERT_MESSAGE("Could not load file: " + path, gb->LoadFromFile(path));
+        gb->SkipBoot = true;
+        if (sink) {
+            gb->SetAudioSink(std::move(sink));
+        }
+        gb->Reset();
+        gb->FastMode = true;
+        return gb;
+    }
     class TestGameboy : public CppUnit::TestFixture {
-        static void testSingleMooneye(std::string path, TestResult* result);
+        static void testSingleMooneye(std::string path, Devices::PPUBackend backend, TestResult* result);
         static void testSingleBlargg(std::string path, TestResult* result);
+        static void hashFrames(std::string path, FrameHashes* hashes);
+        static void hashAudio(std::string path, uint64_t instructions, std::string* hash);
+        void runAllMooneye(Devices::PPUBackend backend);
         void testAllMooneye();
+        void testAllMooneyeFifo();
+        void testMultiInstanceDeterminism();
+        void testAudioHashes();
+        void testSaveStates();
+        void testRewind();
+        void testRunAhead();
+        void testMovies();
+        void testStateHash();
+        void testSpriteCache();
+        void testUpscaler();
         CPPUNIT_TEST_SUITE(TestGameboy);
         CPPUNIT_TEST(testAllMooneye);
+        CPPUNIT_TEST(testAllMooneyeFifo);
+        CPPUNIT_TEST(testMultiInstanceDeterminism);
+        CPPUNIT_TEST(testAudioHashes);
+        CPPUNIT_TEST(testSaveStates);
+        CPPUNIT_TEST(testRewind);
+        CPPUNIT_TEST(testRunAhead);
+        CPPUNIT_TEST(testMovies);
+        CPPUNIT_TEST(testStateHash);
+        CPPUNIT_TEST(testSpriteCache);
+        CPPUNIT_TEST(testUpscaler);
         CPPUNIT_TEST_SUITE_END();
         std::string gameboy_tests_path_ = std::filesystem::current_path().string() + "/../GameboyTKP/tests/";
         std::vector<TestResult> mooneye_results_;
     };
-    void TestGameboy::testAllMooneye() {
+    // Measurements, registered apart from the tests so a QA run doesn't wait
+    // for them. Run with the "benchmarks" argument of the test runner
+    class BenchmarkGameboy : public CppUnit::TestFixture {
+        void benchmarkPPUBackends();
+        void benchmarkRunAhead();
+        void benchmarkSaveStates();
+        CPPUNIT_TEST_SUITE(BenchmarkGameboy);
+        CPPUNIT_TEST(benchmarkPPUBackends);
+        CPPUNIT_TEST(benchmarkRunAhead);
+        CPPUNIT_TEST(benchmarkSaveStates);
+        CPPUNIT_TEST_SUITE_END();
+        std::string gameboy_tests_path_ = std::filesystem::current_path().string() + "/../GameboyTKP/tests/";
+    };
+    void TestGameboy::runAllMooneye(Devices::PPUBackend backend) {
         using rdi = std::filesystem::recursive_directory_iterator;
         mooneye_results_.clear();
         std::vector<std::function<void()>> gb_jobs;
@@ -31,7 +87,7 @@ namespace TKPEmu::Gameboy::QA {
             if (entry.is_regular_file() && entry.path().extension() == ".gb") {
                 std::string name = entry.path().parent_path().filename().string() + "/" + entry.path().filename().string();
                 mooneye_results_[i] = {false, name};
-                std::function<void()> job = std::bind(testSingleMooneye, entry.path().string(), &mooneye_results_[i]);
+                std::function<void()> job = std::bind(testSingleMooneye, entry.path().string(), backend, &mooneye_results_[i]);
                 gb_jobs.push_back(job);
                 ++i;
             }
@@ -41,6 +97,10 @@ namespace TKPEmu::Gameboy::QA {
         std::sort(mooneye_results_.begin(), mooneye_results_.end(), [](const auto& lhs, const auto& rhs) {
             return lhs.second < rhs.second;
         });
+    }
+    void TestGameboy::testAllMooneye() {
+        runAllMooneye(Devices::PPUBackend::Scanline);
+        unsigned count = mooneye_results_.size();
         int fail_count = 0;
         std::ofstream ofs("result.md");
         ofs << "## [Gekkio](https://github.com/Gekkio)'s tests:\n\n";
@@ -52,16 +112,537 @@ namespace TKPEmu::Gameboy::QA {
         }
         CPPUNIT_ASSERT_EQUAL_MESSAGE("Not all tests passed", count, count - fail_count);
     }
-    void TestGameboy::testSingleMooneye(std::string path, TestResult* result) {
-        TKPEmu::Gameboy::Gameboy_TKPWrapper gb_;
-        CPPUNIT_ASSERT_MESSAGE("Could not load file: " + path, gb_.LoadFromFile(path));
-        gb_.SkipBoot = true;
-        gb_.Reset();
-        gb_.FastMode = true;
-        auto& cpu = gb_.cpu_;
+    // The FIFO backend must pass every test but these, and none of them
+    void TestGameboy::testAllMooneyeFifo() {
+        const std::set<std::string> failing = {
+            "acceptance/boot_div-S.gb",
+            "acceptance/boot_div-dmg0.gb",
+            "acceptance/boot_div-dmgABCmgb.gb",
+            "acceptance/boot_div2-S.gb",
+            "acceptance/boot_hwio-S.gb",
+            "acceptance/boot_hwio-dmg0.gb",
+            "acceptance/boot_hwio-dmgABCmgb.gb",
+            "acceptance/boot_regs-dmg0.gb",
+            "acceptance/boot_regs-mgb.gb",
+            "acceptance/boot_regs-sgb.gb",
+            "acceptance/boot_regs-sgb2.gb",
+            "acceptance/di_timing-GS.gb",
+            "acceptance/halt_ime0_nointr_timing.gb",
+            "acceptance/halt_ime1_timing2-GS.gb",
+            "bits/unused_hwio-C.gb",
+            "bits/unused_hwio-GS.gb",
+            "manual-only/sprite_priority.gb",
+            "mbc1/multicart_rom_8Mb.gb",
+            "mbc1/rom_1Mb.gb",
+            "mbc1/rom_2Mb.gb",
+            "mbc1/rom_512kb.gb",
+            "misc/boot_div-A.gb",
+            "misc/boot_div-cgb0.gb",
+            "misc/boot_div-cgbABCDE.gb",
+            "misc/boot_hwio-C.gb",
+            "misc/boot_regs-A.gb",
+            "misc/boot_regs-cgb.gb",
+            "oam_dma/sources-GS.gb",
+            "ppu/intr_1_2_timing-GS.gb",
+            "ppu/intr_2_mode0_timing_sprites.gb",
+            "ppu/lcdon_timing-GS.gb",
+            "ppu/lcdon_write_timing-GS.gb",
+            "ppu/stat_irq_blocking.gb",
+            "ppu/stat_lyc_onoff.gb",
+            "ppu/vblank_stat_intr-C.gb",
+            "serial/boot_sclk_align-dmgABCmgb.gb",
+            "timer/rapid_toggle.gb",
+        };
+        runAllMooneye(Devices::PPUBackend::Fifo);
+        for (auto& r : mooneye_results_) {
+            bool expected = !failing.contains(r.second);
+            CPPUNIT_ASSERT_EQUAL_MESSAGE(r.second + (expected ? " failed" : " passed"), expected, r.first);
+        }
+    }
+    // Instances running in parallel must produce the same frames and sound
+    // state as the same roms run one at a time
+    void TestGameboy::testMultiInstanceDeterminism() {
+        constexpr int copies = 4;
+        std::vector<std::string> roms = { "acid/dmg-acid2.gb", "acid/cgb-acid2.gbc", "blarg/dmg_sound/03-trigger.gb" };
+        std::vector<FrameHashes> single(roms.size());
+        for (size_t i = 0; i < roms.size(); i++) {
+            hashFrames(gameboy_tests_path_ + roms[i], &single[i]);
+        }
+        std::vector<FrameHashes> parallel(roms.size() * copies);
+        std::vector<std::function<void()>> gb_jobs;
+        for (size_t i = 0; i < parallel.size(); i++) {
+            gb_jobs.push_back(std::bind(hashFrames, gameboy_tests_path_ + roms[i % roms.size()], &parallel[i]));
+        }
+        TKPEmu::Tools::FixedTaskThreadPool fttp(gb_jobs);
+        fttp.StartAllAndWait();
+        for (size_t i = 0; i < parallel.size(); i++) {
+            CPPUNIT_ASSERT_MESSAGE("Parallel run differs: " + roms[i % roms.size()], single[i % roms.size()] == parallel[i]);
+        }
+    }
+    void TestGameboy::hashFrames(std::string path, FrameHashes* hashes) {
+        constexpr size_t frames = 300;
+        auto sink = std::make_unique<Devices::HashAudioSink>(48000, 2);
+        auto* audio = sink.get();
+        auto gb = createGameboy(path, std::move(sink));
+        bool& ready = gb->IsReadyToDraw();
+        while (hashes->size() < frames) {
+            gb->Update();
+            if (ready) {
+                ready = false;
+                gb->GetScreenData();
+                uint64_t hash = gb->GetFrameInfo().Hash;
+                hash = (hash ^ audio->GetCurrentHash()) * 0x100000001B3;
+                hash = (hash ^ audio->GetSecondHashes().size()) * 0x100000001B3;
+                for (auto& channel : *gb->channel_array_ptr_) {
+                    for (int value : { channel.FrequencyTimer, channel.WaveDutyPosition, channel.LengthTimer,
+                            channel.PeriodTimer, int(channel.EnvelopeCurrentVolume), int(channel.LFSR) }) {
+                        hash = (hash ^ value) * 0x100000001B3;
+                    }
+                }
+                hashes->push_back(hash);
+            }
+        }
+    }
+    // Every rom in expected_audio_results.csv is run for its instruction
+    // count, the sound of each second has to match
+    void TestGameboy::testAudioHashes() {
+        struct AudioTest {
+            std::string name;
+            std::string path;
+            uint64_t instructions;
+            std::string expected;
+            std::string hash;
+        };
+        // Names are the path without the extension, from the test suite's
+        // directory, spaces and underscores are used interchangeably
+        auto normalize = [](std::string name) {
+            std::replace(name.begin(), name.end(), '_', ' ');
+            return name;
+        };
+        std::map<std::string, std::string> roms;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(gameboy_tests_path_)) {
+            auto ext = entry.path().extension();
+            if (entry.is_regular_file() && (ext == ".gb" || ext == ".gbc")) {
+                auto name = std::filesystem::relative(entry.path(), gameboy_tests_path_).replace_extension().generic_string();
+                roms[normalize("/" + name)] = entry.path().string();
+            }
+        }
+        std::vector<AudioTest> tests;
+        // Kept apart from expected_results.csv, whose format the frontend reads
+        std::ifstream csv(gameboy_tests_path_ + "../expected_audio_results.csv");
+        std::string line;
+        // rom md5, instructions, audio hashes, name (may contain commas)
+        while (std::getline(csv, line)) {
+            std::vector<std::string> fields;
+            size_t start = 0;
+            for (int i = 0; i < 3; i++) {
+                size_t comma = line.find(',', start);
+                if (comma == std::string::npos) {
+                    break;
+                }
+                fields.push_back(line.substr(start, comma - start));
+                start = comma + 1;
+            }
+            if (fields.size() != 3 || fields[2].empty()) {
+                continue;
+            }
+            std::string name = line.substr(start);
+            auto suffix = normalize("/" + name);
+            auto rom = std::find_if(roms.begin(), roms.end(), [&suffix](const auto& r) {
+                return r.first.ends_with(suffix);
+            });
+            CPPUNIT_ASSERT_MESSAGE("Rom not found: " + name, rom != roms.end());
+            tests.push_back({ name, rom->second, std::stoull(fields[1]), fields[2], "" });
+        }
+        CPPUNIT_ASSERT_MESSAGE("No audio hashes in expected_audio_results.csv", !tests.empty());
+        std::vector<std::function<void()>> gb_jobs;
+        for (auto& test : tests) {
+            gb_jobs.push_back(std::bind(hashAudio, test.path, test.instructions, &test.hash));
+        }
+        TKPEmu::Tools::FixedTaskThreadPool fttp(gb_jobs);
+        fttp.StartAllAndWait();
+        for (auto& test : tests) {
+            if (test.hash != test.expected) {
+                // Each second is 8 hex digits and a dash
+                size_t second = 0;
+                while (second * 9 < std::min(test.hash.size(), test.expected.size()) && test.hash.compare(second * 9, 8, test.expected, second * 9, 8) == 0) {
+                    ++second;
+                }
+                CPPUNIT_ASSERT_MESSAGE("Audio differs from second " + std::to_string(second) + ": " + test.name, false);
+            }
+        }
+    }
+    void TestGameboy::hashAudio(std::string path, uint64_t instructions, std::string* hash) {
+        auto sink = std::make_unique<Devices::HashAudioSink>(48000, 2);
+        auto* audio = sink.get();
+        auto gb = createGameboy(path, std::move(sink));
+        for (uint64_t i = 0; i < instructions; i++) {
+            gb->Update();
+        }
+        *hash = audio->GetHashString();
+    }
+    // Running on from a loaded state has to give the same frames and final
+    // state as running on from where it was saved. Sound is synthesized so the
+    // channels are saved mid-frame too
+    void TestGameboy::testSaveStates() {
+        using PPUBackend = Devices::PPUBackend;
+        constexpr int frames = 120;
+        for (std::string rom : { "acid/dmg-acid2.gb", "acid/cgb-acid2.gbc", "blarg/dmg_sound/03-trigger.gb", "blarg/instr_timing.gb" }) {
+            for (auto backend : { PPUBackend::Scanline, PPUBackend::Fifo }) {
+                // The state is loaded into a second emulator that has only been
+                // reset, so a field missing from the state shows up as a difference
+                auto create = [&]() {
+                    auto gb = createGameboy(gameboy_tests_path_ + rom, std::make_unique<Devices::NullAudioSink>(48000, 2));
+                    gb->SetPPUBackend(backend);
+                    return gb;
+                };
+                auto run = [&](TKPEmu::Gameboy::Gameboy_TKPWrapper& gb) {
+                    bool& ready = gb.IsReadyToDraw();
+                    FrameHashes hashes;
+                    ready = false;
+                    while (hashes.size() < frames) {
+                        gb.Update();
+                        if (ready) {
+                            ready = false;
+                            gb.GetScreenData();
+                            hashes.push_back(gb.GetFrameInfo().Hash);
+                        }
+                    }
+                    return hashes;
+                };
+                auto original = create();
+                auto loaded = create();
+                // Saved in the middle of an instruction stream, not at a frame boundary
+                for (int i = 0; i < 123457; i++) {
+                    original->Update();
+                }
+                std::vector<uint8_t> start, end, reloaded_end;
+                original->SaveState(start);
+                FrameHashes expected = run(*original);
+                original->SaveState(end);
+                CPPUNIT_ASSERT_MESSAGE("State not loaded: " + rom, loaded->LoadState(start));
+                FrameHashes hashes = run(*loaded);
+                loaded->SaveState(reloaded_end);
+                // The screen isn't saved, so the lines of the first frame that
+                // were drawn before saving are missing from it
+                CPPUNIT_ASSERT_MESSAGE("Frames differ after loading: " + rom, std::equal(hashes.begin() + 1, hashes.end(), expected.begin() + 1));
+                CPPUNIT_ASSERT_MESSAGE("State differs after loading: " + rom, end == reloaded_end);
+                std::vector<uint8_t> bad = start;
+                // Version
+                bad[4] ^= 1;
+                CPPUNIT_ASSERT_MESSAGE("Bad state loaded: " + rom, !loaded->LoadState(bad));
+                bad = start;
+                bad.pop_back();
+                CPPUNIT_ASSERT_MESSAGE("Short state loaded: " + rom, !loaded->LoadState(bad));
+                loaded->SaveState(bad);
+                CPPUNIT_ASSERT_MESSAGE("Rejected state changed the emulator: " + rom, bad == reloaded_end);
+            }
+        }
+    }
+    // Every frame rewound to has to be the state that was saved at the end of
+    // it, going back through deltas, full states and after dropping frames
+    void TestGameboy::testRewind() {
+        constexpr int frames = 300;
+        for (std::string rom : { "acid/cgb-acid2.gbc", "blarg/dmg_sound/03-trigger.gb", "blarg/cpu_instrs/09-op r,r.gb" }) {
+            auto gb = createGameboy(gameboy_tests_path_ + rom, std::make_unique<Devices::NullAudioSink>(48000, 2));
+            gb->EnableRewind();
+            // The states the emulator had right after recording each frame
+            std::vector<std::vector<uint8_t>> saved;
+            auto run = [&](int count) {
+                while (count > 0) {
+                    int clk = gb->rewind_clk_;
+                    gb->Update();
+                    if (gb->rewind_clk_ < clk) {
+                        saved.emplace_back();
+                        gb->SaveState(saved.back());
+                        --count;
+                    }
+                }
+            };
+            run(frames);
+            CPPUNIT_ASSERT_EQUAL_MESSAGE("Frames missing: " + rom, frames, gb->GetRewindFrames());
+            size_t used = gb->rewind_->GetUsedBytes();
+            std::vector<uint8_t> state;
+            // Back to the newest frame, then a few frames at a time past and
+            // onto full states
+            for (int back : { 0, 1, 7, 52, 60, 61, 100 }) {
+                CPPUNIT_ASSERT_MESSAGE("Could not rewind: " + rom, gb->Rewind(back));
+                saved.resize(saved.size() - back);
+                gb->SaveState(state);
+                CPPUNIT_ASSERT_MESSAGE("Rewound state differs: " + rom, state == saved.back());
+                CPPUNIT_ASSERT_EQUAL_MESSAGE("Frames not dropped: " + rom, static_cast<int>(saved.size()), gb->GetRewindFrames());
+            }
+            // Running on records from the rewound frame, and emulation from it
+            // has to be the same as the first time
+            run(50);
+            CPPUNIT_ASSERT_MESSAGE("Could not rewind: " + rom, gb->Rewind(30));
+            saved.resize(saved.size() - 30);
+            gb->SaveState(state);
+            CPPUNIT_ASSERT_MESSAGE("Rewound state differs after running on: " + rom, state == saved.back());
+            CPPUNIT_ASSERT_MESSAGE("Older frame kept: " + rom, !gb->Rewind(gb->GetRewindFrames()));
+            // A budget that only fits some of the frames keeps the newest ones
+            gb->EnableRewind(used / 4, 60);
+            saved.clear();
+            run(frames);
+            int kept = gb->GetRewindFrames();
+            CPPUNIT_ASSERT_MESSAGE("Budget not kept: " + rom, kept < frames && kept > frames / 8 && gb->rewind_->GetUsedBytes() <= used / 4);
+            CPPUNIT_ASSERT_MESSAGE("Could not rewind to the oldest frame: " + rom, gb->Rewind(kept - 1));
+            gb->SaveState(state);
+            CPPUNIT_ASSERT_MESSAGE("Oldest frame differs: " + rom, state == saved[frames - kept]);
+        }
+    }
+    void TestGameboy::testRunAhead() {
+        using HashAudioSink = Devices::HashAudioSink;
+        constexpr int frames = 120;
+        for (std::string rom : { "blarg/dmg_sound/03-trigger.gb", "blarg/cpu_instrs/09-op r,r.gb" }) {
+            auto create = [&]() {
+                auto gb = createGameboy(gameboy_tests_path_ + rom, std::make_unique<HashAudioSink>(48000, 2));
+                // Starts at a VBlank like the frames run ahead do
+                gb->run_to_vblank();
+                return gb;
+            };
+            auto audio = [](TKPEmu::Gameboy::Gameboy_TKPWrapper& gb) {
+                return static_cast<HashAudioSink*>(gb.apu_.GetSink())->GetHashString();
+            };
+            // All of them are created first, so they load the same battery save
+            auto normal = create();
+            std::vector<std::unique_ptr<TKPEmu::Gameboy::Gameboy_TKPWrapper>> instances;
+            for (int i = 0; i < 6; i++) {
+                instances.push_back(create());
+            }
+            // Every frame of a normal run, with the state and audio after it
+            FrameHashes expected;
+            std::vector<std::vector<uint8_t>> states(frames);
+            std::vector<std::string> audio_hashes;
+            for (int i = 0; i <= frames + 3; i++) {
+                normal->run_to_vblank();
+                normal->GetScreenData();
+                expected.push_back(normal->GetFrameInfo().Hash);
+                if (i < frames) {
+                    normal->SaveState(states[i]);
+                    audio_hashes.push_back(audio(*normal));
+                }
+            }
+            for (int variant = 0; variant < 6; variant++) {
+                int ahead = variant % 3 + 1;
+                bool second_instance = variant >= 3;
+                std::string name = rom + " " + std::to_string(ahead) + (second_instance ? " frames, second instance" : " frames");
+                auto& gb = instances[variant];
+                gb->SetRunAhead(ahead, second_instance);
+                std::vector<uint8_t> state;
+                for (int i = 0; i < frames; i++) {
+                    gb->run_ahead_frame();
+                    gb->GetScreenData();
+                    CPPUNIT_ASSERT_MESSAGE("Wrong frame shown: " + name, gb->GetFrameInfo().Hash == expected[i + ahead]);
+                    gb->SaveState(state);
+                    CPPUNIT_ASSERT_MESSAGE("Emulation changed: " + name, state == states[i]);
+                    CPPUNIT_ASSERT_MESSAGE("Audio changed: " + name, audio(*gb) == audio_hashes[i]);
+                }
+            }
+        }
+    }
+    void TestGameboy::testMovies() {
+        constexpr int frames = 300;
+        auto movie_path = std::filesystem::temp_directory_path() / "gameboy_test.movie";
+        for (std::string rom : { "acid/cgb-acid2.gbc", "blarg/cpu_instrs/09-op r,r.gb" }) {
+            auto create = [&]() {
+                auto gb = createGameboy(gameboy_tests_path_ + rom);
+                gb->direction_keys_ = { 1, 2, 3, 4 };
+                gb->action_keys_ = { 5, 6, 7, 8 };
+                return gb;
+            };
+            // The state at the start of every frame and a hash of the keys
+            // after every instruction of the frame before it
+            using Frames = std::vector<std::pair<std::vector<uint8_t>, uint32_t>>;
+            auto run = [](TKPEmu::Gameboy::Gameboy_TKPWrapper& gb, Frames& recorded, uint32_t seed) {
+                uint32_t keys_hash = 0x811C9DC5;
+                while (gb.IsPlayingMovie() || recorded.size() < frames) {
+                    int clk = gb.movie_clk_;
+                    gb.Update();
+                    keys_hash = (keys_hash ^ gb.bus_.DirectionKeys ^ (gb.bus_.ActionKeys << 8)) * 0x01000193;
+                    if (gb.movie_clk_ < clk) {
+                        recorded.emplace_back();
+                        gb.SaveState(recorded.back().first);
+                        recorded.back().second = keys_hash;
+                        keys_hash = 0x811C9DC5;
+                    }
+                    // Keys pressed and released in the middle of frames, all
+                    // released in the last frame of a movie
+                    seed = seed * 1103515245 + 12345;
+                    if (recorded.size() == frames) {
+                        for (uint32_t key = 1; key <= 8; key++) {
+                            gb.HandleKeyUp(key);
+                        }
+                    } else if ((seed >> 16) % 2000 == 0) {
+                        uint32_t key = (seed >> 8) % 8 + 1;
+                        if (seed & 0x80) {
+                            gb.HandleKeyDown(key);
+                        } else {
+                            gb.HandleKeyUp(key);
+                        }
+                    }
+                }
+            };
+            auto original = create();
+            for (int i = 0; i < 54321; i++) {
+                original->Update();
+            }
+            original->StartMovieRecording();
+            Frames recorded;
+            run(*original, recorded, 12345);
+            auto movie = original->StopMovieRecording();
+            CPPUNIT_ASSERT_EQUAL_MESSAGE("Frames missing: " + rom, static_cast<size_t>(frames + 1), movie.Keys.size());
+            CPPUNIT_ASSERT_MESSAGE("No keys recorded: " + rom, std::count(movie.Keys.begin(), movie.Keys.end(), 0xFF) < frames);
+            CPPUNIT_ASSERT_MESSAGE("Could not save movie: " + rom, movie.Save(movie_path));
+            TKPEmu::Gameboy::Utils::Movie loaded;
+            CPPUNIT_ASSERT_MESSAGE("Could not load movie: " + rom, loaded.Load(movie_path));
+            // Host keys are ignored while the movie plays, other ones are pressed
+            auto replay = create();
+            CPPUNIT_ASSERT_MESSAGE("Could not play movie: " + rom, replay->StartMoviePlayback(loaded));
+            Frames replayed;
+            run(*replay, replayed, 999);
+            CPPUNIT_ASSERT_MESSAGE("Replay differs: " + rom, std::equal(recorded.begin(), recorded.end(), replayed.begin()));
+            CPPUNIT_ASSERT_MESSAGE("Host keys not back after the movie: " + rom, !replay->IsPlayingMovie() && (replay->bus_.ActionKeys & 0xF) == 0xF);
+            std::vector<uint8_t> fast_end;
+            auto fast = create();
+            CPPUNIT_ASSERT_MESSAGE("Could not run movie: " + rom, fast->RunMovie(loaded));
+            fast->SaveState(fast_end);
+            CPPUNIT_ASSERT_MESSAGE("Fast replay differs: " + rom, replayed.back().first == fast_end);
+            // Only plays on the ROM it was recorded on
+            auto other = std::make_unique<TKPEmu::Gameboy::Gameboy_TKPWrapper>();
+            CPPUNIT_ASSERT_MESSAGE("Could not load file", other->LoadFromFile(gameboy_tests_path_ + "blarg/instr_timing.gb"));
+            CPPUNIT_ASSERT_MESSAGE("Movie played on another ROM: " + rom, !other->StartMoviePlayback(loaded));
+        }
+        std::filesystem::remove(movie_path);
+    }
+    void TestGameboy::testStateHash() {
+        constexpr int frames = 300;
+        for (std::string rom : { "acid/cgb-acid2.gbc", "blarg/dmg_sound/03-trigger.gb", "mooneye/emulator-only/mbc1/ram_256kb.gb", "mooneye/emulator-only/mbc2/ram.gb" }) {
+            auto gb = createGameboy(gameboy_tests_path_ + rom);
+            // Only loads states, so its pages are rehashed by what differs in
+            // them and a write the dirty tracking misses shows up
+            auto loaded = createGameboy(gameboy_tests_path_ + rom);
+            std::map<uint64_t, std::vector<uint8_t>> seen;
+            std::vector<uint8_t> state;
+            for (int i = 0; i < frames; i++) {
+                for (int j = 0; j < 7000; j++) {
+                    gb->Update();
+                }
+                gb->SaveState(state);
+                uint64_t hash = gb->StateHash();
+                CPPUNIT_ASSERT_MESSAGE("Hash changed without emulation: " + rom, hash == gb->StateHash());
+                CPPUNIT_ASSERT_MESSAGE("Could not load state: " + rom, loaded->LoadState(state));
+                uint64_t full = loaded->StateHash();
+                CPPUNIT_ASSERT_MESSAGE("Incremental hash differs: " + rom, hash == full);
+                // Loading the state it's in changes nothing cached from it
+                auto page_versions = gb->bus_.PageVersions;
+                auto tile_versions = gb->bus_.TileVersions;
+                auto oam_version = gb->bus_.OamVersion;
+                CPPUNIT_ASSERT_MESSAGE("Could not load state: " + rom, gb->LoadState(state));
+                CPPUNIT_ASSERT_MESSAGE("Versions changed by an equal state: " + rom, page_versions == gb->bus_.PageVersions
+                    && tile_versions == gb->bus_.TileVersions && oam_version == gb->bus_.OamVersion);
+                auto [it, inserted] = seen.emplace(hash, state);
+                CPPUNIT_ASSERT_MESSAGE("Different states hash the same: " + rom, inserted || it->second == state);
+            }
+            CPPUNIT_ASSERT_MESSAGE("States not told apart: " + rom, seen.size() > frames / 2);
+            // A single byte of memory changes it
+            uint64_t hash = gb->StateHash();
+            gb->bus_.Write(0xC123, gb->bus_.Read(0xC123) ^ 1);
+            CPPUNIT_ASSERT_MESSAGE("Memory write not hashed: " + rom, hash != gb->StateHash());
+        }
+    }
+    // Games run OAM DMA every VBlank, the per-line sprite lists have to be
+    // reused when it copies the same sprites
+    void TestGameboy::testSpriteCache() {
+        auto gb = createGameboy(gameboy_tests_path_ + "acid/dmg-acid2.gb");
+        for (int i = 0; i < 10; i++) {
+            gb->run_to_vblank();
+        }
+        auto& bus = gb->bus_;
+        auto dma = [&]() {
+            bus.Write(addr_dma, 0xC0);
+            gb->run_to_vblank();
+            gb->run_to_vblank();
+        };
+        // Read during VBlank, when OAM isn't blocked
+        for (uint16_t i = 0; i < 0xA0; i++) {
+            bus.Write(0xC000 + i, bus.Read(0xFE00 + i));
+        }
+        uint64_t oam_version = bus.OamVersion;
+        uint64_t generation = gb->ppu_.sprite_cache_generation_;
+        dma();
+        CPPUNIT_ASSERT_MESSAGE("Same OAM copied by DMA changed the version", oam_version == bus.OamVersion);
+        CPPUNIT_ASSERT_MESSAGE("Same OAM copied by DMA dropped the sprite cache", generation == gb->ppu_.sprite_cache_generation_);
+        bus.Write(0xC000, bus.Read(0xC000) + 1);
+        dma();
+        CPPUNIT_ASSERT_MESSAGE("OAM changed by DMA kept the version", oam_version != bus.OamVersion);
+        CPPUNIT_ASSERT_MESSAGE("OAM changed by DMA kept the sprite cache", generation != gb->ppu_.sprite_cache_generation_);
+    }
+    // Every filter has to give the same output whichever kernels (AVX2, SSE2
+    // or scalar) it was built with
+    void TestGameboy::testUpscaler() {
+        using Devices::ScreenFormat;
+        using Utils::UpscaleFilter;
+        struct UpscaleTest {
+            ScreenFormat Format;
+            UpscaleFilter Filter;
+            int Scale;
+            uint64_t Hash;
+        };
+        std::vector<UpscaleTest> tests = {
+            { ScreenFormat::RGBA8888, UpscaleFilter::Nearest, 3, 0x5B10028C07CC970Bull },
+            { ScreenFormat::RGBA8888, UpscaleFilter::Scale2x, 2, 0x1D09EA2E5D453DCEull },
+            { ScreenFormat::RGBA8888, UpscaleFilter::Scale3x, 3, 0xCA50C2C77B16921Aull },
+            { ScreenFormat::RGBA8888, UpscaleFilter::XBR, 2, 0x4E366B3A957BF6A4ull },
+            { ScreenFormat::RGB565, UpscaleFilter::Nearest, 2, 0x1A2DBC52171B8209ull },
+            { ScreenFormat::RGB565, UpscaleFilter::Scale2x, 2, 0x09E09ED6A6546781ull },
+            { ScreenFormat::RGB565, UpscaleFilter::Scale3x, 3, 0x37B4DF667A72EEE6ull },
+            { ScreenFormat::Indexed, UpscaleFilter::Nearest, 4, 0xC0899AD352A3DC7Eull },
+            { ScreenFormat::Indexed, UpscaleFilter::Scale2x, 2, 0xFE7008EEACF21E8Eull },
+            { ScreenFormat::Indexed, UpscaleFilter::Scale3x, 3, 0x34B981F88CFB6E6Full },
+        };
+        std::vector<std::string> roms = { "acid/dmg-acid2.gb", "acid/cgb-acid2.gbc" };
+        {
+            auto gb = createGameboy(gameboy_tests_path_ + roms[0]);
+            gb->SetScreenFormat(ScreenFormat::RGB565);
+            CPPUNIT_ASSERT_MESSAGE("XBR enabled without RGBA8888", !gb->EnableUpscaler(UpscaleFilter::XBR, 2));
+            CPPUNIT_ASSERT_MESSAGE("Nearest enabled at 5x", !gb->EnableUpscaler(UpscaleFilter::Nearest, 5));
+        }
+        for (size_t i = 0; i < tests.size(); i++) {
+            const auto& test = tests[i];
+            std::string name = "upscale test " + std::to_string(i);
+            uint64_t hash = 0;
+            for (const auto& rom : roms) {
+                auto gb = createGameboy(gameboy_tests_path_ + rom);
+                gb->SetScreenFormat(test.Format);
+                // Shades of gray for the DMG rom, the host sets none by default
+                gb->bus_.Palette = { { { 0xFF, 0xFF, 0xFF }, { 0xAA, 0xAA, 0xAA }, { 0x55, 0x55, 0x55 }, { 0x00, 0x00, 0x00 } } };
+                for (int j = 0; j < 60; j++) {
+                    gb->run_to_vblank();
+                }
+                CPPUNIT_ASSERT_MESSAGE("Could not enable the upscaler: " + name, gb->EnableUpscaler(test.Filter, test.Scale));
+                // Pushed by hand, the emulator isn't run on so no other frame arrives
+                auto* upscaler = gb->GetUpscaler();
+                upscaler->Push(gb->ppu_.GetScreenData());
+                auto start = std::chrono::steady_clock::now();
+                while (upscaler->GetProcessedFrames() == 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                const uint8_t* frame = upscaler->GetFrame();
+                CPPUNIT_ASSERT_MESSAGE("Frame not upscaled: " + name, frame != nullptr);
+                size_t bpp = test.Format == ScreenFormat::RGBA8888 ? 4 : test.Format == ScreenFormat::Indexed ? 1 : 2;
+                hash = Utils::HashBytes(frame, upscaler->GetWidth() * upscaler->GetHeight() * bpp, hash);
+            }
+            CPPUNIT_ASSERT_EQUAL_MESSAGE("Output differs: " + name, test.Hash, hash);
+        }
+    }
+    void TestGameboy::testSingleMooneye(std::string path, Devices::PPUBackend backend, TestResult* result) {
+        auto gb = createGameboy(path);
+        gb->SetPPUBackend(backend);
+        auto& cpu = gb->cpu_;
         #define must(a, b) if (a != b) { result->first = false; return; }
         for (unsigned i = 0; i < 4'000'000; i++) {
-            gb_.Update();
+            gb->Update();
             if (cpu.GetLastInstr() == 0x40) {
                 must(uint8_t(0x03), cpu.B);
                 must(uint8_t(0x05), cpu.C);
@@ -78,16 +659,108 @@ namespace TKPEmu::Gameboy::QA {
         CPPUNIT_ASSERT_MESSAGE("4 million instructions exceeded", false);
     }
     void TestGameboy::testSingleBlargg(std::string path, TestResult* result) {
-        TKPEmu::Gameboy::Gameboy_TKPWrapper gb_;
-        CPPUNIT_ASSERT_MESSAGE("Could not load file: " + path, gb_.LoadFromFile(path));
-        gb_.SkipBoot = true;
-        gb_.Reset();
-        gb_.FastMode = true;
-        auto& cpu = gb_.cpu_;
+        auto gb = createGameboy(path);
+        auto& cpu = gb->cpu_;
 
 
         result->first = false;
         CPPUNIT_ASSERT_MESSAGE("10 million instructions exceeded", false);
     }
+    // Prints the frames per second of both PPU backends on the acid tests
+    void BenchmarkGameboy::benchmarkPPUBackends() {
+        using PPUBackend = Devices::PPUBackend;
+        constexpr int frames = 600;
+        for (std::string rom : { "acid/dmg-acid2.gb", "acid/cgb-acid2.gbc" }) {
+            for (auto backend : { PPUBackend::Scanline, PPUBackend::Fifo }) {
+                auto gb = createGameboy(gameboy_tests_path_ + rom);
+                gb->SetPPUBackend(backend);
+                bool& ready = gb->IsReadyToDraw();
+                int drawn = 0;
+                auto start = std::chrono::steady_clock::now();
+                while (drawn < frames) {
+                    gb->Update();
+                    if (ready) {
+                        ready = false;
+                        ++drawn;
+                    }
+                }
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << rom << " " << (backend == PPUBackend::Fifo ? "fifo" : "scanline") << ": "
+                    << frames / elapsed.count() << " fps" << std::endl;
+            }
+        }
+    }
+    // Prints the time per shown frame with up to 3 frames of run-ahead, and
+    // what each frame run ahead adds
+    void BenchmarkGameboy::benchmarkRunAhead() {
+        constexpr int frames = 600;
+        for (std::string rom : { "acid/cgb-acid2.gbc", "blarg/dmg_sound/03-trigger.gb" }) {
+            for (bool second_instance : { false, true }) {
+                double base = 0;
+                for (int ahead = 0; ahead <= 3; ahead++) {
+                    auto gb = createGameboy(gameboy_tests_path_ + rom, std::make_unique<Devices::NullAudioSink>(48000, 2));
+                    gb->SetRunAhead(ahead, second_instance);
+                    auto start = std::chrono::steady_clock::now();
+                    for (int i = 0; i < frames; i++) {
+                        if (ahead != 0) {
+                            gb->run_ahead_frame();
+                        } else {
+                            gb->run_to_vblank();
+                        }
+                    }
+                    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                    double per_frame = elapsed.count() / frames;
+                    if (ahead == 0) {
+                        base = per_frame;
+                    }
+                    std::cout << rom << (second_instance ? " second instance, " : ", ") << ahead << " ahead: "
+                        << per_frame << " ms per frame";
+                    if (ahead != 0) {
+                        std::cout << ", " << (per_frame - base) / ahead << " ms more per frame ahead";
+                    }
+                    std::cout << std::endl;
+                }
+            }
+        }
+    }
+    // Prints how long saving, loading and hashing a state take, and how much
+    // memory a rewind frame takes. Saving has to stay under 20 us so a state
+    // can be saved every frame
+    void BenchmarkGameboy::benchmarkSaveStates() {
+        constexpr int iterations = 1000;
+        constexpr int frames = 300;
+        for (std::string rom : { "acid/cgb-acid2.gbc", "blarg/dmg_sound/03-trigger.gb", "blarg/cpu_instrs/09-op r,r.gb" }) {
+            auto gb = createGameboy(gameboy_tests_path_ + rom, std::make_unique<Devices::NullAudioSink>(48000, 2));
+            for (int i = 0; i < 123457; i++) {
+                gb->Update();
+            }
+            std::vector<uint8_t> state;
+            auto t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                gb->SaveState(state);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                gb->LoadState(state);
+            }
+            auto t2 = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::micro> save = (t1 - t0) / iterations, load = (t2 - t1) / iterations;
+            std::cout << rom << ": " << state.size() << " bytes, save " << save.count() << " us, load " << load.count() << " us" << std::endl;
+            CPPUNIT_ASSERT_MESSAGE("Saving takes over 20 us: " + rom, save.count() < 20);
+            // The hash of a frame only rehashes the pages written during it
+            gb->EnableRewind();
+            std::chrono::duration<double, std::micro> hash_time{};
+            for (int i = 0; i < frames; i++) {
+                gb->run_to_vblank();
+                auto start = std::chrono::steady_clock::now();
+                gb->StateHash();
+                hash_time += std::chrono::steady_clock::now() - start;
+            }
+            size_t used = gb->rewind_->GetUsedBytes();
+            std::cout << rom << ": " << hash_time.count() / frames << " us per hash, " << used / frames << " bytes per rewind frame, "
+                << (64 << 20) / (used / frames) / 3600 << " minutes in 64 MB" << std::endl;
+        }
+    }
     CPPUNIT_TEST_SUITE_REGISTRATION(TestGameboy);
+    CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(BenchmarkGameboy, "benchmarks");
 }
\ No newline at end of file
@@ -2,8 +2,11 @@
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/ui/text/TestRunner.h>
 
-int main() {
-    CppUnit::Test *suite = CppUnit::TestFactoryRegistry::getRegistry().makeTest();
+// Runs the tests, or the suites registered under the name given as the
+// first argument (e.g. "benchmarks")
+int main(int argc, char** argv) {
+    auto& registry = argc > 1 ? CppUnit::TestFactoryRegistry::getRegistry(argv[1]) : CppUnit::TestFactoryRegistry::getRegistry();
+    CppUnit::Test *suite = registry.makeTest();
     CppUnit::TextUi::TestRunner runner;
     runner.addTest(suite);
     runner.setOutputter(new CppUnit::CompilerOutputter(&runner.result(), std::cerr));